@@ -19,14 +19,18 @@
 #include "List.h"
 #include "Hash.h"
 #include "Debug.h"
+#include "IoBuf.h"
 #include "Log.h"
 #include "Mem.h"
 #include "Path.h"
+#include "Sock.h"
 #include "Str.h"
 #include "Sync.h"
 #include "Task.h"
+#include "File.h"
 #include "Thread.h"
 #include "Time.h"
+#include "Timer.h"
 
 
 //===================================
@@ -0,0 +1,202 @@
+/******************************************************************************
+*
+*   File.cpp
+*   
+*
+***/
+
+
+#include "stdafx.h"
+#pragma hdrstop
+
+
+/******************************************************************************
+*
+*   Private
+*
+***/
+
+// Sizes of the pooled buffers; larger buffers are allocated individually
+static const unsigned s_bufferBytes[] = {
+    4 * 1024,
+    16 * 1024,
+    64 * 1024,
+    256 * 1024,
+};
+
+static CMemPool s_pool4k(4 * 1024, 16, FILE_ALIGN_BYTES);
+static CMemPool s_pool16k(16 * 1024, 4, FILE_ALIGN_BYTES);
+static CMemPool s_pool64k(64 * 1024, 1, FILE_ALIGN_BYTES);
+static CMemPool s_pool256k(256 * 1024, 1, FILE_ALIGN_BYTES);
+
+static CMemPool * const s_pools[] = {
+    &s_pool4k,
+    &s_pool16k,
+    &s_pool64k,
+    &s_pool256k,
+};
+CCASSERT(_countof(s_pools) == _countof(s_bufferBytes));
+
+//=============================================================================
+static CMemPool * FindPool (unsigned bytes) {
+    for (unsigned i = 0; i < _countof(s_bufferBytes); ++i) {
+        if (bytes <= s_bufferBytes[i])
+            return s_pools[i];
+    }
+    return NULL;
+}
+
+//=============================================================================
+static void InitOverlapped (OVERLAPPED * olap, u64 offset) {
+    ZERO(*olap);
+    olap->Offset     = (DWORD) offset;
+    olap->OffsetHigh = (DWORD) (offset >> 32);
+}
+
+
+/******************************************************************************
+*
+*   Exports
+*
+***/
+
+//=============================================================================
+HANDLE FileOpenAsync (const wchar path[], unsigned flags, CTask * task) {
+    DWORD access = 0;
+    if (flags & FILE_OPEN_READ)
+        access |= GENERIC_READ;
+    if (flags & FILE_OPEN_WRITE)
+        access |= GENERIC_WRITE;
+
+    DWORD disposition;
+    if (flags & FILE_OPEN_CREATE)
+        disposition = (flags & FILE_OPEN_TRUNCATE) ? CREATE_ALWAYS : OPEN_ALWAYS;
+    else
+        disposition = (flags & FILE_OPEN_TRUNCATE) ? TRUNCATE_EXISTING : OPEN_EXISTING;
+
+    DWORD attributes = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED;
+    if (flags & FILE_OPEN_UNBUFFERED)
+        attributes |= FILE_FLAG_NO_BUFFERING;
+    if (flags & FILE_OPEN_WRITE_THROUGH)
+        attributes |= FILE_FLAG_WRITE_THROUGH;
+
+    HANDLE file = CreateFileW(
+        path,
+        access,
+        FILE_SHARE_READ,
+        NULL,
+        disposition,
+        attributes,
+        NULL
+    );
+    if (file == INVALID_HANDLE_VALUE)
+        return file;
+
+    TaskRegisterHandle(task, file);
+    return file;
+}
+
+//=============================================================================
+void FileClose (HANDLE file) {
+    CloseHandle(file);
+}
+
+//=============================================================================
+u64 FileGetSize (HANDLE file) {
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        LOG_OS_LAST_ERROR(L"GetFileSizeEx");
+        return 0;
+    }
+    return (u64) size.QuadPart;
+}
+
+//=============================================================================
+bool FileReadAsync (
+    HANDLE          file,
+    u64             offset,
+    void *          buffer,
+    unsigned        bytes,
+    OVERLAPPED *    olap
+) {
+    // The completion is queued even if the read finishes immediately
+    InitOverlapped(olap, offset);
+    if (ReadFile(file, buffer, bytes, NULL, olap))
+        return true;
+
+    DWORD error = GetLastError();
+    if (error == ERROR_IO_PENDING)
+        return true;
+    if (error != ERROR_HANDLE_EOF)
+        LOG_OS_ERROR(L"ReadFile", error);
+    SetLastError(error);
+    return false;
+}
+
+//=============================================================================
+bool FileWriteAsync (
+    HANDLE          file,
+    u64             offset,
+    const void *    buffer,
+    unsigned        bytes,
+    OVERLAPPED *    olap
+) {
+    InitOverlapped(olap, offset);
+    if (WriteFile(file, buffer, bytes, NULL, olap))
+        return true;
+
+    DWORD error = GetLastError();
+    if (error == ERROR_IO_PENDING)
+        return true;
+    LOG_OS_ERROR(L"WriteFile", error);
+    return false;
+}
+
+//=============================================================================
+void * FileBufferAlloc (unsigned bytes) {
+    if (CMemPool * pool = FindPool(bytes))
+        return pool->Alloc();
+
+    // Whole pages, so the buffer is aligned
+    void * buffer = VirtualAlloc(NULL, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!buffer) {
+        LOG_OS_LAST_ERROR(L"VirtualAlloc");
+        FatalError();
+    }
+    return buffer;
+}
+
+//=============================================================================
+void FileBufferFree (void * buffer, unsigned bytes) {
+    if (!buffer)
+        return;
+    if (CMemPool * pool = FindPool(bytes))
+        pool->Free(buffer);
+    else
+        VirtualFree(buffer, 0, MEM_RELEASE);
+}
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================
@@ -0,0 +1,153 @@
+/******************************************************************************
+*
+*   File.h
+*   
+*
+***/
+
+
+#ifdef FILE_H
+#error "Header included more than once"
+#endif
+#define FILE_H
+
+
+/******************************************************************************
+*
+*   WHAT IT IS
+*
+*   Positional reads and writes that complete through the task system, so
+*   saving and loading files doesn't block a task thread that should be
+*   processing other completions.
+*
+*   HOW TO USE IT
+*
+*       class CLoader : public CTask {
+*           HANDLE      m_file;
+*           OVERLAPPED  m_olap;
+*           void *      m_buffer;
+*
+*           void Load () {
+*               m_file   = FileOpenAsync(path, FILE_OPEN_READ | FILE_OPEN_UNBUFFERED, this);
+*               m_buffer = FileBufferAlloc(BYTES);
+*               FileReadAsync(m_file, 0, m_buffer, BYTES, &m_olap);
+*           }
+*
+*           void TaskComplete (unsigned bytes, OVERLAPPED * olap) {
+*               if (FileOpFailed(olap))
+*                   ...
+*           }
+*       };
+*
+***/
+
+
+/******************************************************************************
+*
+*   Types
+*
+***/
+
+enum EFileOpen {
+    FILE_OPEN_READ          = 1 << 0,
+    FILE_OPEN_WRITE         = 1 << 1,
+
+    // Create the file if it doesn't exist
+    FILE_OPEN_CREATE        = 1 << 2,
+
+    // Discard the file's contents; requires FILE_OPEN_WRITE
+    FILE_OPEN_TRUNCATE      = 1 << 3,
+
+    // Bypass the system cache. Offsets, sizes and buffer addresses must
+    // be multiples of FILE_ALIGN_BYTES; buffers from FileBufferAlloc are.
+    FILE_OPEN_UNBUFFERED    = 1 << 4,
+
+    // Writes complete once they reach the disk
+    FILE_OPEN_WRITE_THROUGH = 1 << 5,
+};
+
+// Alignment required for unbuffered I/O; a page, which is a multiple of
+// the sector size of any disk Windows supports
+const unsigned FILE_ALIGN_BYTES = 4 * 1024;
+
+
+/******************************************************************************
+*
+*   Functions
+*
+***/
+
+// Completions for reads and writes go to task->TaskComplete with the
+// OVERLAPPED passed to FileReadAsync or FileWriteAsync. Returns
+// INVALID_HANDLE_VALUE if the file couldn't be opened; GetLastError has
+// the reason.
+HANDLE FileOpenAsync (
+    __in    const wchar     path[],
+    __in    unsigned        flags,      // EFileOpen
+    __in    CTask *         task
+);
+
+// Pending operations complete with errors
+void FileClose (HANDLE file);
+
+u64 FileGetSize (HANDLE file);
+
+// The buffer and OVERLAPPED must stay valid until the operation completes.
+// Returns false if the operation couldn't be started, in which case there
+// is no completion. A read that starts at or past the end of the file
+// either returns false with GetLastError() == ERROR_HANDLE_EOF or, more
+// often, completes with zero bytes and an end-of-file status, which
+// FileOpFailed doesn't count as a failure; a read that runs past the end
+// completes with fewer bytes than requested.
+bool FileReadAsync (
+    __in    HANDLE          file,
+    __in    u64             offset,
+    __out   void *          buffer,
+    __in    unsigned        bytes,
+    __in    OVERLAPPED *    olap
+);
+bool FileWriteAsync (
+    __in    HANDLE          file,
+    __in    u64             offset,
+    __in    const void *    buffer,
+    __in    unsigned        bytes,
+    __in    OVERLAPPED *    olap
+);
+
+// End of file isn't a failure; the read completes with zero bytes
+inline bool FileOpFailed (const OVERLAPPED * olap) {
+    const long statusEndOfFile = (long) 0xC0000011;    // STATUS_END_OF_FILE
+    long status = (long) olap->Internal;
+    return status < 0 && status != statusEndOfFile;
+}
+
+// Buffers aligned for unbuffered I/O. Sizes are rounded up to a multiple
+// of FILE_ALIGN_BYTES, and common sizes come from pools, so steady-state
+// I/O doesn't reach the heap. Free with the size passed to alloc.
+void * FileBufferAlloc (unsigned bytes);
+void FileBufferFree (void * buffer, unsigned bytes);
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================
@@ -0,0 +1,294 @@
+/******************************************************************************
+*
+*   IoBuf.cpp
+*   
+*
+***/
+
+
+#include "stdafx.h"
+#pragma hdrstop
+
+
+/******************************************************************************
+*
+*   Private
+*
+***/
+
+// Capacity of each size class; requests above the last are allocated
+// individually
+static const unsigned s_classBytes[] = {
+    256,
+    1024,
+    4 * 1024,
+    16 * 1024,
+    64 * 1024,
+};
+
+static const unsigned SIZE_CLASSES = _countof(s_classBytes);
+static const unsigned NO_SIZE_CLASS = (unsigned) -1;
+
+// Fewer blocks per slab for the larger classes keeps slabs a similar size
+static CMemPool s_pool256(sizeof(IoBuffer) + 256, 256, IOBUFFER_ALIGN_BYTES);
+static CMemPool s_pool1k(sizeof(IoBuffer) + 1024, 64, IOBUFFER_ALIGN_BYTES);
+static CMemPool s_pool4k(sizeof(IoBuffer) + 4 * 1024, 16, IOBUFFER_ALIGN_BYTES);
+static CMemPool s_pool16k(sizeof(IoBuffer) + 16 * 1024, 4, IOBUFFER_ALIGN_BYTES);
+static CMemPool s_pool64k(sizeof(IoBuffer) + 64 * 1024, 1, IOBUFFER_ALIGN_BYTES);
+
+static CMemPool * const s_pools[] = {
+    &s_pool256,
+    &s_pool1k,
+    &s_pool4k,
+    &s_pool16k,
+    &s_pool64k,
+};
+CCASSERT(_countof(s_pools) == _countof(s_classBytes));
+
+static CMemPool s_slicePool(sizeof(IoSlice), 256);
+
+
+/******************************************************************************
+*
+*   IoBuffer
+*
+***/
+
+//=============================================================================
+IoBuffer * IoBufferAlloc (unsigned bytes) {
+    unsigned sizeClass = 0;
+    while (sizeClass < SIZE_CLASSES && s_classBytes[sizeClass] < bytes)
+        ++sizeClass;
+
+    IoBuffer * buffer;
+    if (sizeClass < SIZE_CLASSES) {
+        buffer = (IoBuffer *) s_pools[sizeClass]->Alloc();
+        buffer->capacity = s_classBytes[sizeClass];
+    }
+    else {
+        sizeClass = NO_SIZE_CLASS;
+        buffer = (IoBuffer *) ALLOC(sizeof(IoBuffer) + bytes);
+        buffer->capacity = bytes;
+    }
+
+    buffer->refs        = 1;
+    buffer->sizeClass   = sizeClass;
+    return buffer;
+}
+
+//=============================================================================
+void IoBufferAddRef (IoBuffer * buffer) {
+    InterlockedIncrement(&buffer->refs);
+}
+
+//=============================================================================
+void IoBufferRelease (IoBuffer * buffer) {
+    if (InterlockedDecrement(&buffer->refs))
+        return;
+
+    if (buffer->sizeClass == NO_SIZE_CLASS)
+        MemFree(buffer);
+    else
+        s_pools[buffer->sizeClass]->Free(buffer);
+}
+
+
+/******************************************************************************
+*
+*   IoSlice
+*
+***/
+
+//=============================================================================
+IoSlice * IoSliceCreate (IoBuffer * buffer, unsigned offset, unsigned bytes) {
+    ASSERT(offset + bytes <= buffer->capacity);
+    IoBufferAddRef(buffer);
+
+    IoSlice * slice = (IoSlice *) s_slicePool.Alloc();
+    slice->next     = NULL;
+    slice->buffer   = buffer;
+    slice->data     = buffer->Data() + offset;
+    slice->bytes    = bytes;
+    return slice;
+}
+
+//=============================================================================
+void IoSliceFree (IoSlice * slice) {
+    IoBufferRelease(slice->buffer);
+    s_slicePool.Free(slice);
+}
+
+
+/******************************************************************************
+*
+*   CIoChain
+*
+***/
+
+//=============================================================================
+CIoChain::CIoChain ()
+:   m_head(NULL)
+,   m_tail(NULL)
+,   m_bytes(0)
+{}
+
+//=============================================================================
+CIoChain::~CIoChain () {
+    Clear();
+}
+
+//=============================================================================
+void CIoChain::AppendSlice (IoSlice * slice) {
+    slice->next = NULL;
+    if (m_tail)
+        m_tail->next = slice;
+    else
+        m_head = slice;
+    m_tail = slice;
+    m_bytes += slice->bytes;
+}
+
+//=============================================================================
+void CIoChain::Append (IoBuffer * buffer, unsigned offset, unsigned bytes) {
+    if (bytes)
+        AppendSlice(IoSliceCreate(buffer, offset, bytes));
+}
+
+//=============================================================================
+void CIoChain::Append (const void * data, unsigned bytes) {
+    const byte * src = (const byte *) data;
+    while (bytes) {
+        // The tail slice can grow into the rest of its buffer if no other
+        // slice or owner can see the buffer
+        IoSlice * tail = m_tail;
+        unsigned room = 0;
+        if (tail && IoBufferIsExclusive(tail->buffer))
+            room = (unsigned) (tail->buffer->Data() + tail->buffer->capacity - (tail->data + tail->bytes));
+
+        if (!room) {
+            IoBuffer * buffer = IoBufferAlloc(bytes < s_classBytes[2] ? s_classBytes[2] : bytes);
+            tail = IoSliceCreate(buffer, 0, 0);
+            IoBufferRelease(buffer);    // the slice holds the only reference
+            AppendSlice(tail);
+            room = buffer->capacity;
+        }
+
+        unsigned copy = room < bytes ? room : bytes;
+        memcpy(tail->data + tail->bytes, src, copy);
+        tail->bytes += copy;
+        m_bytes     += copy;
+        src         += copy;
+        bytes       -= copy;
+    }
+}
+
+//=============================================================================
+void CIoChain::Append (CIoChain * chain) {
+    if (!chain->m_head)
+        return;
+
+    if (m_tail)
+        m_tail->next = chain->m_head;
+    else
+        m_head = chain->m_head;
+    m_tail      = chain->m_tail;
+    m_bytes    += chain->m_bytes;
+
+    chain->m_head   = NULL;
+    chain->m_tail   = NULL;
+    chain->m_bytes  = 0;
+}
+
+//=============================================================================
+void CIoChain::Split (unsigned bytes, CIoChain * front) {
+    ASSERT(bytes <= m_bytes);
+    while (bytes && m_head) {
+        IoSlice * slice = m_head;
+        if (slice->bytes <= bytes) {
+            if (NULL == (m_head = slice->next))
+                m_tail = NULL;
+            m_bytes -= slice->bytes;
+            bytes   -= slice->bytes;
+            front->AppendSlice(slice);
+            continue;
+        }
+
+        // Share the buffer between a new front slice and the remainder
+        unsigned offset = (unsigned) (slice->data - slice->buffer->Data());
+        front->Append(slice->buffer, offset, bytes);
+        slice->data  += bytes;
+        slice->bytes -= bytes;
+        m_bytes      -= bytes;
+        bytes         = 0;
+    }
+}
+
+//=============================================================================
+void CIoChain::Consume (unsigned bytes) {
+    ASSERT(bytes <= m_bytes);
+    while (bytes && m_head) {
+        IoSlice * slice = m_head;
+        if (slice->bytes <= bytes) {
+            if (NULL == (m_head = slice->next))
+                m_tail = NULL;
+            m_bytes -= slice->bytes;
+            bytes   -= slice->bytes;
+            IoSliceFree(slice);
+            continue;
+        }
+
+        slice->data  += bytes;
+        slice->bytes -= bytes;
+        m_bytes      -= bytes;
+        bytes         = 0;
+    }
+}
+
+//=============================================================================
+unsigned CIoChain::CopyOut (void * dst, unsigned bytes) const {
+    byte * out = (byte *) dst;
+    unsigned copied = 0;
+    for (const IoSlice * slice = m_head; slice && copied < bytes; slice = slice->next) {
+        unsigned copy = bytes - copied;
+        if (copy > slice->bytes)
+            copy = slice->bytes;
+        memcpy(out + copied, slice->data, copy);
+        copied += copy;
+    }
+    return copied;
+}
+
+//=============================================================================
+void CIoChain::Clear () {
+    while (IoSlice * slice = m_head) {
+        m_head = slice->next;
+        IoSliceFree(slice);
+    }
+    m_tail  = NULL;
+    m_bytes = 0;
+}
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================
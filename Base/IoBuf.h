@@ -0,0 +1,170 @@
+/******************************************************************************
+*
+*   IoBuf.h
+*   
+*
+***/
+
+
+#ifdef IOBUF_H
+#error "Header included more than once"
+#endif
+#define IOBUF_H
+
+
+/******************************************************************************
+*
+*   WHAT IT IS
+*
+*   Reference-counted I/O buffers that can be sliced and chained, so data
+*   can go from a receive completion through parsing to a send without
+*   being copied. An IoBuffer is storage; an IoSlice is a view of part of
+*   an IoBuffer that holds a reference to it; a CIoChain is a list of
+*   slices that together form a byte stream.
+*
+*   Buffers come in size classes from lock-free pools (see CMemPool), so
+*   any thread can free a buffer allocated on another without locking.
+*
+*   HOW TO USE IT
+*
+*       CIoChain message;
+*       sock->AppendRead(data, bytes, &message);    // no copy
+*       ...
+*       CIoChain header;
+*       message.Split(HEADER_BYTES, &header);       // no copy
+*       ...
+*       sock->Send(&message);                       // no copy
+*
+***/
+
+
+/******************************************************************************
+*
+*   IoBuffer
+*
+***/
+
+// Data() is aligned to IOBUFFER_ALIGN_BYTES for pooled buffers, so it can
+// hold 8-byte fields and suits SIMD copies
+const unsigned IOBUFFER_ALIGN_BYTES = 16;
+
+struct IoBuffer {
+    volatile long   refs;
+    unsigned        sizeClass;
+    unsigned        capacity;       // bytes available at Data()
+    unsigned        pad;            // keeps Data() aligned
+
+    byte * Data () { return (byte *) (this + 1); }
+    const byte * Data () const { return (const byte *) (this + 1); }
+};
+CCASSERT(sizeof(IoBuffer) % IOBUFFER_ALIGN_BYTES == 0);
+
+// Returns a buffer with a reference count of one and at least "bytes" of
+// capacity; requests larger than the biggest size class are allocated
+// individually
+IoBuffer * IoBufferAlloc (unsigned bytes);
+void IoBufferAddRef (IoBuffer * buffer);
+void IoBufferRelease (IoBuffer * buffer);
+
+// True if the caller holds the only reference, so the buffer can be
+// written without affecting anyone else
+inline bool IoBufferIsExclusive (const IoBuffer * buffer) {
+    return buffer->refs == 1;
+}
+
+
+/******************************************************************************
+*
+*   IoSlice
+*
+***/
+
+struct IoSlice {
+    IoSlice *   next;
+    IoBuffer *  buffer;     // the slice holds a reference
+    byte *      data;       // within buffer->Data()
+    unsigned    bytes;
+};
+
+// Adds a reference to the buffer
+IoSlice * IoSliceCreate (IoBuffer * buffer, unsigned offset, unsigned bytes);
+
+// Releases the buffer reference
+void IoSliceFree (IoSlice * slice);
+
+
+/******************************************************************************
+*
+*   CIoChain
+*
+***/
+
+class CIoChain {
+public:
+    CIoChain ();
+    ~CIoChain ();
+
+    unsigned Bytes () const { return m_bytes; }
+    bool Empty () const { return !m_head; }
+    IoSlice * Head () const { return m_head; }
+
+    // Adds a slice referencing part of the buffer
+    void Append (IoBuffer * buffer, unsigned offset, unsigned bytes);
+
+    // Copies the data. It goes into the unused space after the tail slice
+    // when the chain holds the only reference to the tail's buffer, and
+    // otherwise into new buffers of at least 4KB.
+    void Append (const void * data, unsigned bytes);
+
+    // Moves all of the chain's slices to the end of this one
+    void Append (CIoChain * chain);
+
+    // Moves the first "bytes" to the end of "front", splitting a slice
+    // if necessary; both halves share the buffer
+    void Split (unsigned bytes, CIoChain * front);
+
+    // Discards the first "bytes"
+    void Consume (unsigned bytes);
+
+    // Copies up to "bytes" from the front without consuming them;
+    // returns the number of bytes copied
+    unsigned CopyOut (void * dst, unsigned bytes) const;
+
+    void Clear ();
+
+private:
+    IoSlice *   m_head;
+    IoSlice *   m_tail;
+    unsigned    m_bytes;
+
+    void AppendSlice (IoSlice * slice);
+
+    // Hide copy-constructor and assignment operator
+    CIoChain (const CIoChain &);
+    CIoChain & operator= (const CIoChain &);
+};
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================
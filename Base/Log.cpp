@@ -88,14 +88,13 @@ void LogErrorV (const char fmt[], va_list args) {
     if (!s_log)
         return;
     
-    SYSTEMTIME time;
-    GetSystemTime(&time);
+    unsigned secs = TimeGetCoarseUtcSecs();
     fprintf(
         s_log,
         "%02u:%02u:%02u ",
-        time.wHour,
-        time.wMinute,
-        time.wSecond
+        secs / 3600,
+        secs / 60 % 60,
+        secs % 60
     );
     vfprintf(
         s_log,
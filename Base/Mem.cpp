@@ -84,6 +84,77 @@ void *  MemRealloc (void * ptr, size_t bytes, const char file[], int line) {
 }
 
 
+/******************************************************************************
+*
+*   CMemPool
+*
+***/
+
+//=============================================================================
+static inline size_t AlignBlockBytes (size_t bytes, size_t alignBytes = MEMORY_ALLOCATION_ALIGNMENT) {
+    return (bytes + alignBytes - 1) & ~(alignBytes - 1);
+}
+
+//=============================================================================
+CMemPool::CMemPool (size_t blockBytes, unsigned blocksPerSlab, size_t alignBytes)
+:   m_slabs(NULL)
+,   m_alignBytes(alignBytes < MEMORY_ALLOCATION_ALIGNMENT ? MEMORY_ALLOCATION_ALIGNMENT : alignBytes)
+,   m_blocksPerSlab(blocksPerSlab ? blocksPerSlab : 1)
+{
+    ASSERT(!(m_alignBytes & (m_alignBytes - 1)));
+    m_blockBytes = AlignBlockBytes(
+        blockBytes < sizeof(SLIST_ENTRY) ? sizeof(SLIST_ENTRY) : blockBytes,
+        m_alignBytes
+    );
+    InitializeSListHead(&m_freeList);
+}
+
+//=============================================================================
+CMemPool::~CMemPool () {
+    while (Slab * slab = m_slabs) {
+        m_slabs = slab->next;
+        MemFree(slab);
+    }
+}
+
+//=============================================================================
+void * CMemPool::Grow () {
+    // Blocks follow the slab header, which is padded so that every block
+    // meets the alignment the free list requires. Larger alignments need
+    // room to move the first block up to the next boundary.
+    size_t headerBytes = AlignBlockBytes(sizeof(Slab));
+    size_t slackBytes  = m_alignBytes - MEMORY_ALLOCATION_ALIGNMENT;
+    Slab * slab = (Slab *) ALLOC(headerBytes + slackBytes + m_blockBytes * m_blocksPerSlab);
+
+    // Link the slab for cleanup without taking a lock
+    for (;;) {
+        Slab * next = m_slabs;
+        slab->next  = next;
+        if (InterlockedCompareExchangePointer((void * volatile *) &m_slabs, slab, next) == next)
+            break;
+    }
+
+    // Keep the first block for the caller and share the rest
+    byte * block = (byte *) AlignBlockBytes((size_t) slab + headerBytes, m_alignBytes);
+    for (unsigned i = 1; i < m_blocksPerSlab; ++i)
+        InterlockedPushEntrySList(&m_freeList, (SLIST_ENTRY *) (block + i * m_blockBytes));
+    return block;
+}
+
+//=============================================================================
+void * CMemPool::Alloc () {
+    if (void * block = InterlockedPopEntrySList(&m_freeList))
+        return block;
+    return Grow();
+}
+
+//=============================================================================
+void CMemPool::Free (void * ptr) {
+    if (ptr)
+        InterlockedPushEntrySList(&m_freeList, (SLIST_ENTRY *) ptr);
+}
+
+
 //===================================
 // MIT License
 //
@@ -57,6 +57,42 @@ inline void operator delete (void * p) {
 }
 
 
+//=============================================================================
+// Fixed-size block allocator. Freed blocks go onto a lock-free list and
+// are reused, so once the pool has grown to its working size allocation
+// never reaches the heap or takes a lock. Memory is returned to the heap
+// only when the pool is destroyed. The alignment must be a power of two.
+class CMemPool {
+public:
+    CMemPool (
+        size_t      blockBytes,
+        unsigned    blocksPerSlab = 64,
+        size_t      alignBytes = MEMORY_ALLOCATION_ALIGNMENT
+    );
+    ~CMemPool ();
+
+    void * Alloc ();
+    void Free (void * ptr);
+
+private:
+    struct Slab {
+        Slab *  next;
+    };
+
+    SLIST_HEADER    m_freeList;     // first member so it gets the allocation's alignment
+    Slab * volatile m_slabs;
+    size_t          m_blockBytes;
+    size_t          m_alignBytes;
+    unsigned        m_blocksPerSlab;
+
+    void * Grow ();
+
+    // Hide copy-constructor and assignment operator
+    CMemPool (const CMemPool &);
+    CMemPool & operator= (const CMemPool &);
+};
+
+
 //===================================
 // MIT License
 //
@@ -0,0 +1,1654 @@
+/******************************************************************************
+*
+*   Sock.cpp
+*   
+*
+***/
+
+
+#include "stdafx.h"
+#pragma hdrstop
+
+#pragma comment(lib, "ws2_32.lib")
+
+
+/******************************************************************************
+*
+*   Private
+*
+***/
+
+// Size of the buffers used for receiving
+static const unsigned SOCK_BUFFER_BYTES = 4 * 1024;
+
+// Most slices a connection passes to one WSASend
+static const unsigned SEND_GATHER_MAX = 16;
+
+// AcceptEx calls each listener keeps outstanding
+static const unsigned ACCEPTS_PENDING = 8;
+
+// An accept that couldn't be started, usually because the process is out
+// of sockets or buffers, is tried again after this long
+static const unsigned ACCEPT_RETRY_MS = 1000;
+
+// WSARecvFrom calls each UDP endpoint keeps outstanding
+static const unsigned UDP_RECVS_PENDING = 32;
+
+// Lets a burst of datagrams queue in the kernel while receives are reposted
+static const int UDP_RECV_BUFFER_BYTES = 1024 * 1024;
+
+// Stop ICMP "port unreachable" replies to our sends from failing receives
+#ifndef SIO_UDP_CONNRESET
+#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR, 12)
+#endif
+
+// Length prefix of a framed message
+static const unsigned MSG_HEADER_BYTES = sizeof(u32);
+
+// Framed messages up to this size are copied into the send queue directly
+static const unsigned MSG_COALESCE_BYTES = 256;
+
+// AcceptEx requires 16 bytes more than the address size for each address
+static const unsigned ACCEPT_ADDR_BYTES = sizeof(sockaddr_in) + 16;
+
+// Most bytes one TransmitFile call can send
+static const unsigned TRANSMIT_FILE_MAX_BYTES = 0x7ffffffe;
+
+struct SockBuf {
+    SockBuf *   next;
+    unsigned    bytes;
+    byte        data[SOCK_BUFFER_BYTES];
+};
+
+// A range of a file queued by SendFile
+struct FileSend {
+    FileSend *  next;
+    HANDLE      file;
+    u64         offset;
+    unsigned    bytes;
+    void *      context;
+    bool        notify;         // false for all but the last piece of a large range
+    unsigned    queuedBefore;   // bytes of the send queue to send first
+};
+
+class CSockConn;
+
+struct SockIdKey {
+    unsigned    id;
+    unsigned GetHashValue () const { return id; }
+    bool operator== (const CSockConn & conn) const;
+};
+
+class CSockConn : public CTask, public ISock {
+public:
+    LIST_LINK(CSockConn)    m_link;
+    HASH_LINK(CSockConn)    m_hashById;
+    SockIdKey               m_id;
+
+    CSockConn (SOCKET sock, ISockNotify * notify, const sockaddr_in & remoteAddr);
+    ~CSockConn ();
+
+    void AddRef ();
+    bool AddRefIfOpen ();
+    void Release ();
+    bool IsClosing () const { return m_closing; }
+    void Start ();
+    void StartConnect ();
+
+    // From ISock
+    unsigned GetId () const;
+    const sockaddr_in & GetRemoteAddr () const;
+    void Send (const void * data, unsigned bytes);
+    void Send (CIoChain * chain);
+    void SendFile (HANDLE file, u64 offset, unsigned bytes, void * context);
+    void AppendRead (const byte data[], unsigned bytes, CIoChain * chain);
+    void SetTimeouts (unsigned readMs, unsigned sendMs);
+    void Disconnect ();
+
+    // From CTask
+    void TaskComplete (
+        unsigned        bytes,
+        OVERLAPPED *    olap
+    );
+
+private:
+    CCritSect       m_critsect;
+    SOCKET          m_sock;
+    ISockNotify *   m_notify;
+    sockaddr_in     m_remoteAddr;
+    volatile long   m_refs;             // one for being open, one per pending operation
+    bool            m_closing;
+    bool            m_sending;
+    bool            m_sendingFile;      // the send in flight is m_fileHead
+    IoBuffer *      m_recvBuf;
+    CIoChain        m_sendQueue;        // waiting to be sent
+    CIoChain        m_sendInFlight;     // passed to WSASend
+    FileSend *      m_fileHead;         // waiting to be sent, in order
+    FileSend *      m_fileTail;
+    unsigned        m_fileQueuedBytes;  // sum of queuedBefore for m_fileHead..m_fileTail
+    bool            m_flushQueued;
+    TaskWork        m_flushWork;
+    OVERLAPPED      m_readOlap;
+    OVERLAPPED      m_sendOlap;
+    OVERLAPPED      m_connectOlap;
+    unsigned        m_readTimeoutMs;
+    unsigned        m_sendTimeoutMs;
+    TaskDeadline    m_readDeadline;
+    TaskDeadline    m_sendDeadline;
+
+    static void FlushProc (void * context);
+
+    void StartRead ();
+    bool StartSend_CS ();
+    bool StartSendFile_CS ();
+    bool QueueSend_CS ();
+    bool HasSend_CS () const;
+    void OnConnect (bool failed);
+    void OnRead (unsigned bytes, bool failed);
+    void OnSend (unsigned bytes, bool failed);
+};
+
+struct AcceptOp {
+    OVERLAPPED  olap;
+    SOCKET      sock;
+    byte        addrs[2 * ACCEPT_ADDR_BYTES];
+};
+
+class CSockListener : public CTask, public ISockListener {
+public:
+    LIST_LINK(CSockListener) m_link;
+
+    CSockListener (SOCKET sock, ISockListenNotify * notify, unsigned port);
+    ~CSockListener ();
+
+    void AddRef ();
+    void Release ();
+    bool IsClosing () const { return m_closing; }
+    void Start ();
+
+    // From ISockListener
+    unsigned GetPort () const;
+    void Close ();
+
+    // From CTask
+    void TaskComplete (
+        unsigned        bytes,
+        OVERLAPPED *    olap
+    );
+
+private:
+    CCritSect               m_critsect;
+    SOCKET                  m_sock;
+    ISockListenNotify *     m_notify;
+    unsigned                m_port;
+    volatile long           m_refs;     // one for being open, one per pending accept
+    bool                    m_closing;
+    AcceptOp                m_accepts[ACCEPTS_PENDING];
+
+    void StartAccept (AcceptOp * op);
+    void RetryAccept (AcceptOp * op);
+
+    friend struct AcceptRetry;
+};
+
+// Restarts an accept that couldn't be started
+struct AcceptRetry : public ITimerCallback {
+    CSockListener * listener;
+    AcceptOp *      op;
+    ITimer *        timer;
+
+    unsigned OnTimer ();
+};
+
+// A UDP send or receive
+struct UdpOp {
+    OVERLAPPED  olap;
+    UdpOp *     next;           // while waiting to be delivered
+    SockBuf *   buf;
+    sockaddr_in addr;
+    int         addrBytes;
+    DWORD       flags;
+    bool        send;
+};
+
+class CUdpSock : public CTask, public IUdpSock {
+public:
+    LIST_LINK(CUdpSock) m_link;
+
+    CUdpSock (SOCKET sock, IUdpNotify * notify, unsigned port);
+    ~CUdpSock ();
+
+    void AddRef ();
+    void Release ();
+    bool IsClosing () const { return m_closing; }
+    void Start ();
+
+    // From IUdpSock
+    unsigned GetPort () const;
+    void Send (const UdpDatagram datagrams[], unsigned count);
+    void Close ();
+
+    // From CTask
+    void TaskComplete (
+        unsigned        bytes,
+        OVERLAPPED *    olap
+    );
+
+private:
+    CCritSect       m_critsect;
+    SOCKET          m_sock;
+    IUdpNotify *    m_notify;
+    unsigned        m_port;
+    volatile long   m_refs;             // one for being open, one per pending operation
+    bool            m_closing;
+    UdpOp *         m_recvHead;         // received, waiting for the flush
+    UdpOp *         m_recvTail;
+    bool            m_flushQueued;
+    TaskWork        m_flushWork;
+
+    static void FlushProc (void * context);
+
+    void StartRecv (UdpOp * op);
+    void Flush ();
+};
+
+
+static CCritSect                                        s_critsect;
+static LIST_DECLARE(CSockConn, m_link)                  s_conns;
+static HASH_DECLARE(CSockConn, SockIdKey, m_hashById)   s_connsById(1024);
+static LIST_DECLARE(CSockListener, m_link)              s_listeners;
+static LIST_DECLARE(CUdpSock, m_link)                   s_udpSocks;
+static long                                             s_nextId;
+static CMemPool *                                       s_bufPool;
+static CMemPool *                                       s_udpOpPool;
+static CMemPool *                                       s_fileSendPool;
+static HANDLE                                           s_destroyEvt;   // wakes SockDestroy
+
+static LPFN_ACCEPTEX                s_acceptEx;
+static LPFN_CONNECTEX               s_connectEx;
+static LPFN_GETACCEPTEXSOCKADDRS    s_getAcceptExSockaddrs;
+static LPFN_TRANSMITFILE            s_transmitFile;
+
+
+//=============================================================================
+// Overlapped socket operations report their status in the OVERLAPPED
+static inline bool OpFailed (const OVERLAPPED * olap) {
+    return (long) olap->Internal < 0;
+}
+
+//=============================================================================
+static SockBuf * BufAlloc () {
+    SockBuf * buf = (SockBuf *) s_bufPool->Alloc();
+    buf->next  = NULL;
+    buf->bytes = 0;
+    return buf;
+}
+
+//=============================================================================
+static void BufFree (SockBuf * buf) {
+    s_bufPool->Free(buf);
+}
+
+//=============================================================================
+static UdpOp * UdpOpAlloc (bool send) {
+    UdpOp * op = (UdpOp *) s_udpOpPool->Alloc();
+    ZERO(op->olap);
+    op->next    = NULL;
+    op->buf     = BufAlloc();
+    op->send    = send;
+    return op;
+}
+
+//=============================================================================
+static void UdpOpFree (UdpOp * op) {
+    BufFree(op->buf);
+    s_udpOpPool->Free(op);
+}
+
+//=============================================================================
+// Returns INVALID_SOCKET on failure, which is usually resource exhaustion
+static SOCKET SocketCreate (int type = SOCK_STREAM, int protocol = IPPROTO_TCP) {
+    SOCKET sock = WSASocket(AF_INET, type, protocol, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (sock == INVALID_SOCKET)
+        LOG_OS_ERROR(L"WSASocket", WSAGetLastError());
+    return sock;
+}
+
+//=============================================================================
+static bool LoadExtension (SOCKET sock, GUID guid, void * func, size_t bytes) {
+    DWORD returned;
+    if (WSAIoctl(
+        sock,
+        SIO_GET_EXTENSION_FUNCTION_POINTER,
+        &guid,
+        sizeof(guid),
+        func,
+        (DWORD) bytes,
+        &returned,
+        NULL,
+        NULL
+    )) {
+        LOG_OS_ERROR(L"WSAIoctl", WSAGetLastError());
+        return false;
+    }
+    return true;
+}
+
+//=============================================================================
+// Called with s_critsect held
+static inline bool SocketsEmpty () {
+    return s_conns.Empty() && s_listeners.Empty() && s_udpSocks.Empty();
+}
+
+//=============================================================================
+// Called with s_critsect held after an object leaves its list
+static void WakeDestroyIfEmpty () {
+    if (s_destroyEvt && SocketsEmpty())
+        SetEvent(s_destroyEvt);
+}
+
+
+/******************************************************************************
+*
+*   CSockConn
+*
+***/
+
+//=============================================================================
+bool SockIdKey::operator== (const CSockConn & conn) const {
+    return id == conn.m_id.id;
+}
+
+//=============================================================================
+CSockConn::CSockConn (SOCKET sock, ISockNotify * notify, const sockaddr_in & remoteAddr)
+:   m_sock(sock)
+,   m_notify(notify)
+,   m_remoteAddr(remoteAddr)
+,   m_refs(1)
+,   m_closing(false)
+,   m_sending(false)
+,   m_sendingFile(false)
+,   m_recvBuf(IoBufferAlloc(SOCK_BUFFER_BYTES))
+,   m_fileHead(NULL)
+,   m_fileTail(NULL)
+,   m_fileQueuedBytes(0)
+,   m_readTimeoutMs(0)
+,   m_sendTimeoutMs(0)
+,   m_flushQueued(false)
+{
+    ZERO(m_readOlap);
+    ZERO(m_sendOlap);
+    ZERO(m_connectOlap);
+
+    // Ids are never zero, so zero can mean "no connection"
+    do {
+        m_id.id = (unsigned) InterlockedIncrement(&s_nextId);
+    } while (!m_id.id);
+
+    // Small messages are coalesced by the send queue rather than by Nagle
+    BOOL noDelay = true;
+    setsockopt(m_sock, IPPROTO_TCP, TCP_NODELAY, (const char *) &noDelay, sizeof(noDelay));
+
+    s_critsect.Enter();
+    s_conns.InsertTail(this);
+    s_connsById.Add(this, m_id.GetHashValue());
+    // SockDestroy disconnects connections made while it waits
+    if (s_destroyEvt)
+        SetEvent(s_destroyEvt);
+    s_critsect.Leave();
+
+    TaskRegisterHandle(this, (HANDLE) m_sock);
+}
+
+//=============================================================================
+CSockConn::~CSockConn () {
+    ASSERT(m_sock == INVALID_SOCKET);
+    ASSERT(!m_fileHead);
+    IoBufferRelease(m_recvBuf);
+}
+
+//=============================================================================
+void CSockConn::AddRef () {
+    InterlockedIncrement(&m_refs);
+}
+
+//=============================================================================
+// For connections found through s_connsById: Release drops the last
+// reference before it unlinks the connection, so one that has reached
+// zero is already being deleted
+bool CSockConn::AddRefIfOpen () {
+    for (;;) {
+        long refs = m_refs;
+        if (!refs)
+            return false;
+        if (InterlockedCompareExchange(&m_refs, refs + 1, refs) == refs)
+            return true;
+    }
+}
+
+//=============================================================================
+void CSockConn::Release () {
+    if (InterlockedDecrement(&m_refs))
+        return;
+
+    // Once it's out of the table SockSend can't find it
+    s_critsect.Enter();
+    m_link.Unlink();
+    m_hashById.Unlink();
+    WakeDestroyIfEmpty();
+    s_critsect.Leave();
+
+    // File ranges that weren't sent
+    while (FileSend * send = m_fileHead) {
+        m_fileHead = send->next;
+        if (send->notify)
+            m_notify->OnSockFileSent(this, send->context, true);
+        s_fileSendPool->Free(send);
+    }
+
+    m_notify->OnSockDisconnect(this);
+    delete this;
+}
+
+//=============================================================================
+void CSockConn::Start () {
+    // The callback may disconnect, which would otherwise release the
+    // last reference
+    AddRef();
+    m_notify->OnSockConnect(this);
+    StartRead();
+    Release();
+}
+
+//=============================================================================
+void CSockConn::StartConnect () {
+    // ConnectEx requires a bound socket
+    sockaddr_in local;
+    ZERO(local);
+    local.sin_family = AF_INET;
+    if (bind(m_sock, (const sockaddr *) &local, sizeof(local))) {
+        LOG_OS_ERROR(L"bind", WSAGetLastError());
+        Disconnect();
+        return;
+    }
+
+    AddRef();
+    if (!s_connectEx(
+        m_sock,
+        (const sockaddr *) &m_remoteAddr,
+        sizeof(m_remoteAddr),
+        NULL,
+        0,
+        NULL,
+        &m_connectOlap
+    )) {
+        int error = WSAGetLastError();
+        if (error != ERROR_IO_PENDING) {
+            LOG_OS_ERROR(L"ConnectEx", error);
+            Disconnect();
+            Release();
+        }
+    }
+}
+
+//=============================================================================
+void CSockConn::StartRead () {
+    m_critsect.Enter();
+    if (m_closing) {
+        m_critsect.Leave();
+        return;
+    }
+
+    // Don't overwrite data that AppendRead handed out
+    if (!IoBufferIsExclusive(m_recvBuf)) {
+        IoBufferRelease(m_recvBuf);
+        m_recvBuf = IoBufferAlloc(SOCK_BUFFER_BYTES);
+    }
+
+    AddRef();
+    WSABUF wsaBuf;
+    wsaBuf.buf = (char *) m_recvBuf->Data();
+    wsaBuf.len = m_recvBuf->capacity;
+    DWORD flags = 0;
+    int error = 0;
+    if (m_readTimeoutMs)
+        TaskDeadlineSet(&m_readDeadline, (HANDLE) m_sock, &m_readOlap, m_readTimeoutMs);
+    if (WSARecv(m_sock, &wsaBuf, 1, NULL, &flags, &m_readOlap, NULL)) {
+        if (WSA_IO_PENDING != (error = WSAGetLastError())) {
+            LOG_OS_ERROR(L"WSARecv", error);
+            TaskDeadlineClear(&m_readDeadline);
+        }
+        else {
+            error = 0;
+        }
+    }
+    m_critsect.Leave();
+
+    if (error) {
+        Disconnect();
+        Release();
+    }
+}
+
+//=============================================================================
+// Sends the queued slices, up to SEND_GATHER_MAX of them, with a single
+// call. Returns false if the send couldn't be started.
+bool CSockConn::StartSend_CS () {
+    ASSERT(!m_sending);
+    ASSERT(HasSend_CS());
+    ASSERT(m_sendInFlight.Empty());
+
+    if (m_fileHead && !m_fileHead->queuedBefore)
+        return StartSendFile_CS();
+
+    // Don't send data queued after the next file range
+    unsigned limit = m_fileHead ? m_fileHead->queuedBefore : m_sendQueue.Bytes();
+    WSABUF wsaBufs[SEND_GATHER_MAX];
+    unsigned count = 0;
+    unsigned bytes = 0;
+    IoSlice * slice = m_sendQueue.Head();
+    for (; slice && bytes < limit && count < SEND_GATHER_MAX; slice = slice->next) {
+        unsigned sliceBytes = slice->bytes;
+        if (sliceBytes > limit - bytes)
+            sliceBytes = limit - bytes;
+        wsaBufs[count].buf = (char *) slice->data;
+        wsaBufs[count].len = sliceBytes;
+        bytes += sliceBytes;
+        ++count;
+    }
+
+    if (m_fileHead) {
+        m_fileHead->queuedBefore -= bytes;
+        m_fileQueuedBytes        -= bytes;
+    }
+
+    // The slices stay alive until the send completes
+    m_sendQueue.Split(bytes, &m_sendInFlight);
+
+    if (m_sendTimeoutMs)
+        TaskDeadlineSet(&m_sendDeadline, (HANDLE) m_sock, &m_sendOlap, m_sendTimeoutMs);
+    if (WSASend(m_sock, wsaBufs, count, NULL, 0, &m_sendOlap, NULL)) {
+        int error = WSAGetLastError();
+        if (error != WSA_IO_PENDING) {
+            LOG_OS_ERROR(L"WSASend", error);
+            TaskDeadlineClear(&m_sendDeadline);
+            return false;
+        }
+    }
+
+    m_sending = true;
+    AddRef();
+    return true;
+}
+
+//=============================================================================
+// Sends the file range at the head of the queue. The offset is passed in
+// the OVERLAPPED, so the file's position isn't used.
+bool CSockConn::StartSendFile_CS () {
+    FileSend * send = m_fileHead;
+    ZERO(m_sendOlap);
+    m_sendOlap.Offset       = (DWORD) send->offset;
+    m_sendOlap.OffsetHigh   = (DWORD) (send->offset >> 32);
+
+    if (m_sendTimeoutMs)
+        TaskDeadlineSet(&m_sendDeadline, (HANDLE) m_sock, &m_sendOlap, m_sendTimeoutMs);
+    if (!s_transmitFile(m_sock, send->file, send->bytes, 0, &m_sendOlap, NULL, 0)) {
+        int error = WSAGetLastError();
+        if (error != WSA_IO_PENDING) {
+            LOG_OS_ERROR(L"TransmitFile", error);
+            TaskDeadlineClear(&m_sendDeadline);
+            return false;
+        }
+    }
+
+    m_sending       = true;
+    m_sendingFile   = true;
+    AddRef();
+    return true;
+}
+
+//=============================================================================
+bool CSockConn::HasSend_CS () const {
+    return m_fileHead || !m_sendQueue.Empty();
+}
+
+//=============================================================================
+// Starts sending what's queued, either now or, on a task thread, once the
+// thread finishes its batch of completions so that everything sent during
+// the batch goes out together. Returns false if the send couldn't be started.
+bool CSockConn::QueueSend_CS () {
+    if (m_sending || m_flushQueued || !HasSend_CS())
+        return true;
+
+    if (TaskPostBatchEnd(&m_flushWork, FlushProc, this)) {
+        m_flushQueued = true;
+        AddRef();
+        return true;
+    }
+
+    return StartSend_CS();
+}
+
+//=============================================================================
+// Sends everything queued during the task thread's batch of completions
+void CSockConn::FlushProc (void * context) {
+    CSockConn * conn = (CSockConn *) context;
+    bool failed = false;
+    conn->m_critsect.Enter();
+    conn->m_flushQueued = false;
+    if (!conn->m_closing && !conn->m_sending && conn->HasSend_CS())
+        failed = !conn->StartSend_CS();
+    conn->m_critsect.Leave();
+
+    if (failed)
+        conn->Disconnect();
+    conn->Release();
+}
+
+//=============================================================================
+void CSockConn::OnConnect (bool failed) {
+    if (failed) {
+        Disconnect();
+        return;
+    }
+
+    setsockopt(m_sock, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+    Start();
+}
+
+//=============================================================================
+void CSockConn::OnRead (unsigned bytes, bool failed) {
+    TaskDeadlineClear(&m_readDeadline);
+
+    // Zero bytes means the other end closed gracefully
+    if (failed || !bytes) {
+        Disconnect();
+        return;
+    }
+
+    m_notify->OnSockRead(this, m_recvBuf->Data(), bytes);
+    StartRead();
+}
+
+//=============================================================================
+void CSockConn::OnSend (unsigned bytes, bool failed) {
+    TaskDeadlineClear(&m_sendDeadline);
+
+    FileSend * sent = NULL;
+    bool fileFailed = false;
+    m_critsect.Enter();
+    m_sending = false;
+
+    // Overlapped sends on a stream socket either complete or fail
+    if (m_sendingFile) {
+        m_sendingFile = false;
+        sent = m_fileHead;
+        if (NULL == (m_fileHead = sent->next))
+            m_fileTail = NULL;
+        if (bytes != sent->bytes)
+            failed = true;
+        fileFailed = failed;
+    }
+    else {
+        if (bytes != m_sendInFlight.Bytes())
+            failed = true;
+        m_sendInFlight.Clear();
+    }
+
+    // Whatever was queued while the send was in flight is already
+    // coalesced, so there's no reason to wait for the end of the batch
+    if (!failed && !m_closing && HasSend_CS())
+        failed = !StartSend_CS();
+    m_critsect.Leave();
+
+    if (sent) {
+        if (sent->notify)
+            m_notify->OnSockFileSent(this, sent->context, fileFailed);
+        s_fileSendPool->Free(sent);
+    }
+
+    if (failed)
+        Disconnect();
+}
+
+//=============================================================================
+unsigned CSockConn::GetId () const {
+    return m_id.id;
+}
+
+//=============================================================================
+const sockaddr_in & CSockConn::GetRemoteAddr () const {
+    return m_remoteAddr;
+}
+
+//=============================================================================
+void CSockConn::Send (const void * data, unsigned bytes) {
+    bool failed = false;
+    m_critsect.Enter();
+    if (!m_closing) {
+        // Small sends fill the tail buffer of the queue
+        m_sendQueue.Append(data, bytes);
+        failed = !QueueSend_CS();
+    }
+    m_critsect.Leave();
+
+    if (failed)
+        Disconnect();
+}
+
+//=============================================================================
+void CSockConn::Send (CIoChain * chain) {
+    bool failed = false;
+    m_critsect.Enter();
+    if (!m_closing) {
+        m_sendQueue.Append(chain);
+        failed = !QueueSend_CS();
+    }
+    m_critsect.Leave();
+
+    // Sends after Disconnect are discarded
+    chain->Clear();
+
+    if (failed)
+        Disconnect();
+}
+
+//=============================================================================
+void CSockConn::SendFile (HANDLE file, u64 offset, unsigned bytes, void * context) {
+    m_critsect.Enter();
+    if (m_closing) {
+        m_critsect.Leave();
+        m_notify->OnSockFileSent(this, context, true);
+        return;
+    }
+
+    // Ranges too large for one TransmitFile are sent in pieces, with
+    // only the last one reporting completion
+    for (;;) {
+        unsigned pieceBytes = bytes < TRANSMIT_FILE_MAX_BYTES ? bytes : TRANSMIT_FILE_MAX_BYTES;
+        FileSend * send = (FileSend *) s_fileSendPool->Alloc();
+        send->next      = NULL;
+        send->file      = file;
+        send->offset    = offset;
+        send->bytes     = pieceBytes;
+        send->context   = context;
+        send->notify    = pieceBytes == bytes;
+
+        // Everything already queued goes first
+        send->queuedBefore  = m_sendQueue.Bytes() - m_fileQueuedBytes;
+        m_fileQueuedBytes  += send->queuedBefore;
+        if (m_fileTail)
+            m_fileTail->next = send;
+        else
+            m_fileHead = send;
+        m_fileTail = send;
+
+        if (send->notify)
+            break;
+        offset += pieceBytes;
+        bytes  -= pieceBytes;
+    }
+
+    bool failed = !QueueSend_CS();
+    m_critsect.Leave();
+
+    if (failed)
+        Disconnect();
+}
+
+//=============================================================================
+void CSockConn::AppendRead (const byte data[], unsigned bytes, CIoChain * chain) {
+    ASSERT(data >= m_recvBuf->Data());
+    ASSERT(data + bytes <= m_recvBuf->Data() + m_recvBuf->capacity);
+    chain->Append(m_recvBuf, (unsigned) (data - m_recvBuf->Data()), bytes);
+}
+
+//=============================================================================
+void CSockConn::SetTimeouts (unsigned readMs, unsigned sendMs) {
+    m_critsect.Enter();
+    m_readTimeoutMs = readMs;
+    m_sendTimeoutMs = sendMs;
+    m_critsect.Leave();
+}
+
+//=============================================================================
+void CSockConn::Disconnect () {
+    m_critsect.Enter();
+    if (m_closing) {
+        m_critsect.Leave();
+        return;
+    }
+    m_closing = true;
+    SOCKET sock = m_sock;
+    m_sock = INVALID_SOCKET;
+    m_critsect.Leave();
+
+    // Pending operations complete with errors and release their references
+    closesocket(sock);
+    Release();
+}
+
+//=============================================================================
+void CSockConn::TaskComplete (unsigned bytes, OVERLAPPED * olap) {
+    bool failed = OpFailed(olap);
+    if (olap == &m_readOlap)
+        OnRead(bytes, failed);
+    else if (olap == &m_sendOlap)
+        OnSend(bytes, failed);
+    else if (olap == &m_connectOlap)
+        OnConnect(failed);
+    else
+        ASSERT(!"unknown operation");
+
+    // Release the reference taken when the operation started
+    Release();
+}
+
+
+/******************************************************************************
+*
+*   CSockListener
+*
+***/
+
+//=============================================================================
+CSockListener::CSockListener (SOCKET sock, ISockListenNotify * notify, unsigned port)
+:   m_sock(sock)
+,   m_notify(notify)
+,   m_port(port)
+,   m_refs(1)
+,   m_closing(false)
+{
+    for (unsigned i = 0; i < ACCEPTS_PENDING; ++i) {
+        ZERO(m_accepts[i].olap);
+        m_accepts[i].sock = INVALID_SOCKET;
+    }
+
+    s_critsect.Enter();
+    s_listeners.InsertTail(this);
+    s_critsect.Leave();
+
+    TaskRegisterHandle(this, (HANDLE) m_sock);
+}
+
+//=============================================================================
+CSockListener::~CSockListener () {
+    ASSERT(m_sock == INVALID_SOCKET);
+}
+
+//=============================================================================
+void CSockListener::AddRef () {
+    InterlockedIncrement(&m_refs);
+}
+
+//=============================================================================
+void CSockListener::Release () {
+    if (InterlockedDecrement(&m_refs))
+        return;
+
+    s_critsect.Enter();
+    m_link.Unlink();
+    WakeDestroyIfEmpty();
+    s_critsect.Leave();
+    delete this;
+}
+
+//=============================================================================
+void CSockListener::Start () {
+    for (unsigned i = 0; i < ACCEPTS_PENDING; ++i)
+        StartAccept(&m_accepts[i]);
+}
+
+//=============================================================================
+void CSockListener::StartAccept (AcceptOp * op) {
+    m_critsect.Enter();
+    if (m_closing) {
+        m_critsect.Leave();
+        return;
+    }
+
+    // Don't receive any data with the accept, so it completes as soon
+    // as the connection is established
+    AddRef();
+    if (INVALID_SOCKET == (op->sock = SocketCreate())) {
+        m_critsect.Leave();
+        RetryAccept(op);
+        return;
+    }
+
+    DWORD bytes;
+    int error = 0;
+    if (!s_acceptEx(
+        m_sock,
+        op->sock,
+        op->addrs,
+        0,
+        ACCEPT_ADDR_BYTES,
+        ACCEPT_ADDR_BYTES,
+        &bytes,
+        &op->olap
+    )) {
+        if (ERROR_IO_PENDING != (error = WSAGetLastError()))
+            LOG_OS_ERROR(L"AcceptEx", error);
+        else
+            error = 0;
+    }
+    m_critsect.Leave();
+
+    if (error) {
+        closesocket(op->sock);
+        op->sock = INVALID_SOCKET;
+        RetryAccept(op);
+    }
+}
+
+//=============================================================================
+// Called with the reference StartAccept took, which the retry keeps so the
+// listener outlives the timer
+void CSockListener::RetryAccept (AcceptOp * op) {
+    AcceptRetry * retry = new AcceptRetry;
+    retry->listener = this;
+    retry->op       = op;
+    TimerCreate(retry, ACCEPT_RETRY_MS, &retry->timer);
+}
+
+//=============================================================================
+unsigned AcceptRetry::OnTimer () {
+    listener->StartAccept(op);
+    listener->Release();
+    timer->Delete();
+    delete this;
+    return TIMER_INFINITE_MS;
+}
+
+//=============================================================================
+unsigned CSockListener::GetPort () const {
+    return m_port;
+}
+
+//=============================================================================
+void CSockListener::Close () {
+    m_critsect.Enter();
+    if (m_closing) {
+        m_critsect.Leave();
+        return;
+    }
+    m_closing = true;
+    SOCKET sock = m_sock;
+    m_sock = INVALID_SOCKET;
+    m_critsect.Leave();
+
+    // Pending accepts complete with errors and release their references
+    closesocket(sock);
+    Release();
+}
+
+//=============================================================================
+void CSockListener::TaskComplete (unsigned, OVERLAPPED * olap) {
+    AcceptOp * op = (AcceptOp *) ((byte *) olap - offsetof(AcceptOp, olap));
+    SOCKET sock = op->sock;
+    op->sock = INVALID_SOCKET;
+
+    // Connections accepted after Close are dropped; SockDestroy may already
+    // have disconnected the others
+    m_critsect.Enter();
+    bool accepted = !OpFailed(olap) && !m_closing;
+    if (accepted) {
+        setsockopt(
+            sock,
+            SOL_SOCKET,
+            SO_UPDATE_ACCEPT_CONTEXT,
+            (const char *) &m_sock,
+            sizeof(m_sock)
+        );
+    }
+    m_critsect.Leave();
+
+    ISockNotify * notify = NULL;
+    sockaddr_in remoteAddr;
+    if (accepted) {
+        sockaddr * local;
+        sockaddr * remote;
+        int localBytes;
+        int remoteBytes;
+        s_getAcceptExSockaddrs(
+            op->addrs,
+            0,
+            ACCEPT_ADDR_BYTES,
+            ACCEPT_ADDR_BYTES,
+            &local,
+            &localBytes,
+            &remote,
+            &remoteBytes
+        );
+        remoteAddr = * (const sockaddr_in *) remote;
+        notify = m_notify->OnSockAccept(remoteAddr);
+    }
+
+    if (notify) {
+        CSockConn * conn = new CSockConn(sock, notify, remoteAddr);
+        conn->Start();
+    }
+    else {
+        closesocket(sock);
+    }
+
+    StartAccept(op);
+    Release();
+}
+
+
+/******************************************************************************
+*
+*   CSockFramer
+*
+***/
+
+//=============================================================================
+CSockFramer::CSockFramer (ISockMsgNotify * notify, unsigned maxMsgBytes)
+:   m_notify(notify)
+,   m_maxMsgBytes(maxMsgBytes)
+{}
+
+//=============================================================================
+// Adds data to the message that spans receives, and delivers it once it's
+// complete. Returns false if the message is too large.
+bool CSockFramer::ReadPartial (ISock * sock, const byte ** data, unsigned * bytes) {
+    unsigned have = m_partial.Bytes();
+    unsigned need = MSG_HEADER_BYTES;
+    if (have >= MSG_HEADER_BYTES) {
+        u32 msgBytes;
+        m_partial.CopyOut(&msgBytes, sizeof(msgBytes));
+        need += msgBytes;
+    }
+
+    unsigned take = need - have;
+    if (take > *bytes)
+        take = *bytes;
+    sock->AppendRead(*data, take, &m_partial);
+    *data  += take;
+    *bytes -= take;
+
+    // Once the header is complete the whole message size is known
+    if (have < MSG_HEADER_BYTES && m_partial.Bytes() >= MSG_HEADER_BYTES) {
+        u32 msgBytes;
+        m_partial.CopyOut(&msgBytes, sizeof(msgBytes));
+        if (msgBytes > m_maxMsgBytes)
+            return false;
+        return ReadPartial(sock, data, bytes);
+    }
+
+    if (m_partial.Bytes() < need)
+        return true;
+
+    // The message is usually split across two receive buffers, so it has
+    // to be copied to be contiguous
+    m_partial.Consume(MSG_HEADER_BYTES);
+    unsigned msgBytes = m_partial.Bytes();
+    IoSlice * slice = m_partial.Head();
+    if (!slice || slice->bytes == msgBytes) {
+        m_notify->OnSockMsg(sock, slice ? slice->data : NULL, msgBytes);
+    }
+    else {
+        IoBuffer * buffer = IoBufferAlloc(msgBytes);
+        m_partial.CopyOut(buffer->Data(), msgBytes);
+        m_notify->OnSockMsg(sock, buffer->Data(), msgBytes);
+        IoBufferRelease(buffer);
+    }
+    m_partial.Clear();
+    return true;
+}
+
+//=============================================================================
+bool CSockFramer::Read (ISock * sock, const byte data[], unsigned bytes) {
+    if (!m_partial.Empty() && !ReadPartial(sock, &data, &bytes))
+        return false;
+
+    // Deliver the messages that are wholly within this receive in place
+    while (bytes >= MSG_HEADER_BYTES) {
+        // The prefix is little-endian, like the processor
+        u32 msgBytes;
+        memcpy(&msgBytes, data, sizeof(msgBytes));
+        if (msgBytes > m_maxMsgBytes)
+            return false;
+        if (msgBytes > bytes - MSG_HEADER_BYTES)
+            break;
+
+        m_notify->OnSockMsg(sock, data + MSG_HEADER_BYTES, msgBytes);
+        data  += MSG_HEADER_BYTES + msgBytes;
+        bytes -= MSG_HEADER_BYTES + msgBytes;
+    }
+
+    // Keep the start of the next message without copying it
+    if (bytes)
+        return ReadPartial(sock, &data, &bytes);
+    return true;
+}
+
+
+/******************************************************************************
+*
+*   CUdpSock
+*
+***/
+
+//=============================================================================
+CUdpSock::CUdpSock (SOCKET sock, IUdpNotify * notify, unsigned port)
+:   m_sock(sock)
+,   m_notify(notify)
+,   m_port(port)
+,   m_refs(1)
+,   m_closing(false)
+,   m_recvHead(NULL)
+,   m_recvTail(NULL)
+,   m_flushQueued(false)
+{
+    s_critsect.Enter();
+    s_udpSocks.InsertTail(this);
+    s_critsect.Leave();
+
+    TaskRegisterHandle(this, (HANDLE) m_sock);
+}
+
+//=============================================================================
+CUdpSock::~CUdpSock () {
+    ASSERT(m_sock == INVALID_SOCKET);
+    ASSERT(!m_recvHead);
+}
+
+//=============================================================================
+void CUdpSock::AddRef () {
+    InterlockedIncrement(&m_refs);
+}
+
+//=============================================================================
+void CUdpSock::Release () {
+    if (InterlockedDecrement(&m_refs))
+        return;
+
+    s_critsect.Enter();
+    m_link.Unlink();
+    WakeDestroyIfEmpty();
+    s_critsect.Leave();
+
+    m_notify->OnUdpClose(this);
+    delete this;
+}
+
+//=============================================================================
+void CUdpSock::Start () {
+    for (unsigned i = 0; i < UDP_RECVS_PENDING; ++i)
+        StartRecv(UdpOpAlloc(false));
+}
+
+//=============================================================================
+void CUdpSock::StartRecv (UdpOp * op) {
+    m_critsect.Enter();
+    if (m_closing) {
+        m_critsect.Leave();
+        UdpOpFree(op);
+        return;
+    }
+
+    AddRef();
+    ZERO(op->olap);
+    op->addrBytes = sizeof(op->addr);
+    op->flags = 0;
+    WSABUF wsaBuf;
+    wsaBuf.buf = (char *) op->buf->data;
+    wsaBuf.len = sizeof(op->buf->data);
+    int error = 0;
+    if (WSARecvFrom(
+        m_sock,
+        &wsaBuf,
+        1,
+        NULL,
+        &op->flags,
+        (sockaddr *) &op->addr,
+        &op->addrBytes,
+        &op->olap,
+        NULL
+    )) {
+        if (WSA_IO_PENDING != (error = WSAGetLastError()))
+            LOG_OS_ERROR(L"WSARecvFrom", error);
+        else
+            error = 0;
+    }
+    m_critsect.Leave();
+
+    // Don't retry, or a persistent error would loop forever
+    if (error) {
+        UdpOpFree(op);
+        Release();
+    }
+}
+
+//=============================================================================
+void CUdpSock::FlushProc (void * context) {
+    CUdpSock * sock = (CUdpSock *) context;
+    sock->Flush();
+    sock->Release();
+}
+
+//=============================================================================
+void CUdpSock::Flush () {
+    m_critsect.Enter();
+    UdpOp * ops = m_recvHead;
+    m_recvHead = NULL;
+    m_recvTail = NULL;
+    m_flushQueued = false;
+    m_critsect.Leave();
+
+    // At most UDP_RECVS_PENDING receives can be waiting
+    UdpDatagram datagrams[UDP_RECVS_PENDING];
+    unsigned count = 0;
+    for (UdpOp * op = ops; op; op = op->next) {
+        ASSERT(count < UDP_RECVS_PENDING);
+        UdpDatagram & datagram = datagrams[count++];
+        datagram.data   = op->buf->data;
+        datagram.bytes  = op->buf->bytes;
+        datagram.addr   = op->addr;
+    }
+    if (count)
+        m_notify->OnUdpRecv(this, datagrams, count);
+
+    while (UdpOp * op = ops) {
+        ops = op->next;
+        StartRecv(op);
+    }
+}
+
+//=============================================================================
+unsigned CUdpSock::GetPort () const {
+    return m_port;
+}
+
+//=============================================================================
+void CUdpSock::Send (const UdpDatagram datagrams[], unsigned count) {
+    // Windows has no call that sends several datagrams at once, but
+    // queueing them all under one lock keeps the per-datagram cost down
+    m_critsect.Enter();
+    for (unsigned i = 0; i < count && !m_closing; ++i) {
+        const UdpDatagram & datagram = datagrams[i];
+        if (datagram.bytes > sizeof(((SockBuf *) 0)->data)) {
+            LogError("UDP datagram too large: %u bytes\n", datagram.bytes);
+            continue;
+        }
+
+        UdpOp * op = UdpOpAlloc(true);
+        memcpy(op->buf->data, datagram.data, datagram.bytes);
+        op->buf->bytes = datagram.bytes;
+        op->addr = datagram.addr;
+
+        WSABUF wsaBuf;
+        wsaBuf.buf = (char *) op->buf->data;
+        wsaBuf.len = op->buf->bytes;
+        AddRef();
+        if (WSASendTo(
+            m_sock,
+            &wsaBuf,
+            1,
+            NULL,
+            0,
+            (const sockaddr *) &op->addr,
+            sizeof(op->addr),
+            &op->olap,
+            NULL
+        )) {
+            int error = WSAGetLastError();
+            if (error != WSA_IO_PENDING) {
+                LOG_OS_ERROR(L"WSASendTo", error);
+                UdpOpFree(op);
+                InterlockedDecrement(&m_refs);  // the open reference is still held
+            }
+        }
+    }
+    m_critsect.Leave();
+}
+
+//=============================================================================
+void CUdpSock::Close () {
+    m_critsect.Enter();
+    if (m_closing) {
+        m_critsect.Leave();
+        return;
+    }
+    m_closing = true;
+    SOCKET sock = m_sock;
+    m_sock = INVALID_SOCKET;
+    m_critsect.Leave();
+
+    // Pending operations complete with errors and release their references
+    closesocket(sock);
+    Release();
+}
+
+//=============================================================================
+void CUdpSock::TaskComplete (unsigned bytes, OVERLAPPED * olap) {
+    UdpOp * op = (UdpOp *) ((byte *) olap - offsetof(UdpOp, olap));
+    if (op->send) {
+        UdpOpFree(op);
+        Release();
+        return;
+    }
+
+    // A failed receive (an oversized datagram, say) is just reposted;
+    // once the socket is closed StartRecv frees the op instead
+    if (OpFailed(olap)) {
+        StartRecv(op);
+        Release();
+        return;
+    }
+
+    // Deliver everything received during this thread's batch together
+    op->buf->bytes = bytes;
+    bool flushNow = false;
+    m_critsect.Enter();
+    if (m_recvTail)
+        m_recvTail->next = op;
+    else
+        m_recvHead = op;
+    m_recvTail = op;
+    op->next = NULL;
+    if (!m_flushQueued) {
+        m_flushQueued = true;
+        AddRef();
+        flushNow = !TaskPostBatchEnd(&m_flushWork, FlushProc, this);
+    }
+    m_critsect.Leave();
+
+    if (flushNow)
+        FlushProc(this);
+    Release();
+}
+
+
+/******************************************************************************
+*
+*   Exports
+*
+***/
+
+//=============================================================================
+// Closing may delete the object, so hold a reference
+static void DisconnectAll () {
+    for (;;) {
+        s_critsect.Enter();
+        CSockConn * conn = s_conns.Head();
+        while (conn && conn->IsClosing())
+            conn = s_conns.Next(conn);
+        if (conn)
+            conn->AddRef();
+        s_critsect.Leave();
+        if (!conn)
+            break;
+
+        conn->Disconnect();
+        conn->Release();
+    }
+}
+
+//=============================================================================
+void SockInitialize () {
+    WSADATA data;
+    if (int error = WSAStartup(MAKEWORD(2, 2), &data)) {
+        LOG_OS_ERROR(L"WSAStartup", error);
+        FatalError();
+    }
+
+    s_bufPool = new CMemPool(sizeof(SockBuf));
+    s_udpOpPool = new CMemPool(sizeof(UdpOp));
+    s_fileSendPool = new CMemPool(sizeof(FileSend));
+
+    // The extension functions are looked up through a socket; the module
+    // can't work without them
+    SOCKET sock = SocketCreate();
+    if (sock == INVALID_SOCKET)
+        FatalError();
+    GUID acceptEx = WSAID_ACCEPTEX;
+    GUID connectEx = WSAID_CONNECTEX;
+    GUID getAcceptExSockaddrs = WSAID_GETACCEPTEXSOCKADDRS;
+    GUID transmitFile = WSAID_TRANSMITFILE;
+    if (!LoadExtension(sock, acceptEx, &s_acceptEx, sizeof(s_acceptEx))
+     || !LoadExtension(sock, connectEx, &s_connectEx, sizeof(s_connectEx))
+     || !LoadExtension(sock, getAcceptExSockaddrs, &s_getAcceptExSockaddrs, sizeof(s_getAcceptExSockaddrs))
+     || !LoadExtension(sock, transmitFile, &s_transmitFile, sizeof(s_transmitFile))
+    ) {
+        FatalError();
+    }
+    closesocket(sock);
+}
+
+//=============================================================================
+void SockDestroy () {
+    s_critsect.Enter();
+    s_destroyEvt = CreateEvent(NULL, false, false, NULL);
+    s_critsect.Leave();
+    if (!s_destroyEvt) {
+        LOG_OS_LAST_ERROR(L"CreateEvent");
+        FatalError();
+    }
+
+    // Closing may delete the object, so hold a reference
+    for (;;) {
+        s_critsect.Enter();
+        CSockListener * listener = s_listeners.Head();
+        while (listener && listener->IsClosing())
+            listener = s_listeners.Next(listener);
+        if (listener)
+            listener->AddRef();
+        s_critsect.Leave();
+        if (!listener)
+            break;
+
+        listener->Close();
+        listener->Release();
+    }
+
+    for (;;) {
+        s_critsect.Enter();
+        CUdpSock * sock = s_udpSocks.Head();
+        while (sock && sock->IsClosing())
+            sock = s_udpSocks.Next(sock);
+        if (sock)
+            sock->AddRef();
+        s_critsect.Leave();
+        if (!sock)
+            break;
+
+        sock->Close();
+        sock->Release();
+    }
+
+    // Wait for the task threads to finish the cancelled operations, and
+    // disconnect connections that complete in the meantime
+    for (;;) {
+        DisconnectAll();
+
+        s_critsect.Enter();
+        bool empty = SocketsEmpty();
+        s_critsect.Leave();
+        if (empty)
+            break;
+        WaitForSingleObject(s_destroyEvt, INFINITE);
+    }
+
+    s_critsect.Enter();
+    CloseHandle(s_destroyEvt);
+    s_destroyEvt = NULL;
+    s_critsect.Leave();
+
+    delete s_udpOpPool;
+    s_udpOpPool = NULL;
+    delete s_fileSendPool;
+    s_fileSendPool = NULL;
+    delete s_bufPool;
+    s_bufPool = NULL;
+    WSACleanup();
+}
+
+//=============================================================================
+bool SockListen (
+    const sockaddr_in &     addr,
+    ISockListenNotify *     notify,
+    ISockListener **        listener
+) {
+    ASSERT(notify);
+    ASSERT(listener);
+    *listener = NULL;
+
+    SOCKET sock = SocketCreate();
+    if (sock == INVALID_SOCKET)
+        return false;
+    if (bind(sock, (const sockaddr *) &addr, sizeof(addr))) {
+        LOG_OS_ERROR(L"bind", WSAGetLastError());
+        closesocket(sock);
+        return false;
+    }
+    if (listen(sock, SOMAXCONN)) {
+        LOG_OS_ERROR(L"listen", WSAGetLastError());
+        closesocket(sock);
+        return false;
+    }
+
+    sockaddr_in bound;
+    int boundBytes = sizeof(bound);
+    if (getsockname(sock, (sockaddr *) &bound, &boundBytes)) {
+        LOG_OS_ERROR(L"getsockname", WSAGetLastError());
+        closesocket(sock);
+        return false;
+    }
+
+    CSockListener * result = new CSockListener(sock, notify, ntohs(bound.sin_port));
+    result->Start();
+    *listener = result;
+    return true;
+}
+
+//=============================================================================
+bool SockConnect (
+    const sockaddr_in &     addr,
+    ISockNotify *           notify
+) {
+    ASSERT(notify);
+    SOCKET sock = SocketCreate();
+    if (sock == INVALID_SOCKET)
+        return false;
+
+    CSockConn * conn = new CSockConn(sock, notify, addr);
+    conn->StartConnect();
+    return true;
+}
+
+//=============================================================================
+bool SockUdpOpen (
+    const sockaddr_in &     addr,
+    IUdpNotify *            notify,
+    IUdpSock **             sock
+) {
+    ASSERT(notify);
+    ASSERT(sock);
+    *sock = NULL;
+
+    SOCKET s = SocketCreate(SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET)
+        return false;
+    if (bind(s, (const sockaddr *) &addr, sizeof(addr))) {
+        LOG_OS_ERROR(L"bind", WSAGetLastError());
+        closesocket(s);
+        return false;
+    }
+
+    sockaddr_in bound;
+    int boundBytes = sizeof(bound);
+    if (getsockname(s, (sockaddr *) &bound, &boundBytes)) {
+        LOG_OS_ERROR(L"getsockname", WSAGetLastError());
+        closesocket(s);
+        return false;
+    }
+
+    // Both are optimizations; carry on if they fail
+    int recvBufferBytes = UDP_RECV_BUFFER_BYTES;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char *) &recvBufferBytes, sizeof(recvBufferBytes));
+    BOOL connReset = false;
+    DWORD returned;
+    WSAIoctl(s, SIO_UDP_CONNRESET, &connReset, sizeof(connReset), NULL, 0, &returned, NULL, NULL);
+
+    CUdpSock * result = new CUdpSock(s, notify, ntohs(bound.sin_port));
+    result->Start();
+    *sock = result;
+    return true;
+}
+
+//=============================================================================
+bool SockSend (unsigned id, const void * data, unsigned bytes) {
+    // The connection can't be freed while it's in the table, but it may
+    // already be closing, in which case it can't be referenced again
+    SockIdKey key;
+    key.id = id;
+    s_critsect.Enter();
+    CSockConn * conn = s_connsById.Find(key);
+    if (conn && (conn->IsClosing() || !conn->AddRefIfOpen()))
+        conn = NULL;
+    s_critsect.Leave();
+    if (!conn)
+        return false;
+
+    conn->Send(data, bytes);
+    conn->Release();
+    return true;
+}
+
+//=============================================================================
+void SockSendMsg (ISock * sock, const void * msg, unsigned bytes) {
+    // Small messages are copied straight into the send queue's tail buffer
+    // so they're coalesced with other sends
+    u32 header = bytes;
+    if (bytes <= MSG_COALESCE_BYTES) {
+        byte frame[MSG_HEADER_BYTES + MSG_COALESCE_BYTES];
+        memcpy(frame, &header, MSG_HEADER_BYTES);
+        memcpy(frame + MSG_HEADER_BYTES, msg, bytes);
+        sock->Send(frame, MSG_HEADER_BYTES + bytes);
+        return;
+    }
+
+    // The header and body must be queued together
+    CIoChain chain;
+    chain.Append(&header, sizeof(header));
+    chain.Append(msg, bytes);
+    sock->Send(&chain);
+}
+
+//=============================================================================
+void SockSendMsg (ISock * sock, CIoChain * msg) {
+    u32 header = msg->Bytes();
+    CIoChain chain;
+    chain.Append(&header, sizeof(header));
+    chain.Append(msg);
+    sock->Send(&chain);
+}
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================
@@ -0,0 +1,258 @@
+/******************************************************************************
+*
+*   Sock.h
+*   
+*
+***/
+
+
+#ifdef SOCK_H
+#error "Header included more than once"
+#endif
+#define SOCK_H
+
+
+/******************************************************************************
+*
+*   WHAT IT IS
+*
+*   Asynchronous TCP connections whose completions are dispatched by the
+*   task threads. All callbacks for one connection are serialized: first
+*   OnSockConnect, then OnSockRead for each receive, and finally exactly
+*   one OnSockDisconnect, after which the ISock is deleted.
+*
+*   HOW TO USE IT
+*
+*       class CEchoServer : public ISockListenNotify, public ISockNotify {
+*           ISockNotify * OnSockAccept (const sockaddr_in &) { return this; }
+*           void OnSockConnect (ISock *) {}
+*           void OnSockRead (ISock * sock, const byte data[], unsigned bytes) {
+*               sock->Send(data, bytes);
+*           }
+*           void OnSockDisconnect (ISock *) {}
+*       };
+*
+*       SockListen(addr, &server, &listener);
+*
+***/
+
+
+/******************************************************************************
+*
+*   Types
+*
+***/
+
+APICLASS ISock;
+
+// Your class should derive from this class to receive connection events
+APICLASS ISockNotify {
+    // The connection is established; receives begin when this returns
+    virtual void OnSockConnect (ISock * sock) = 0;
+
+    // The data is only valid for the duration of the call unless it's
+    // kept with ISock::AppendRead
+    virtual void OnSockRead (ISock * sock, const byte data[], unsigned bytes) = 0;
+
+    // The last callback for the connection; the ISock is deleted when this
+    // returns. Also called without OnSockConnect if a connect fails.
+    virtual void OnSockDisconnect (ISock * sock) = 0;
+
+    // A file range passed to ISock::SendFile has been sent, or failed
+    // because the connection closed; the file can now be closed. Unlike
+    // the other callbacks, this can run at the same time as OnSockRead.
+    virtual void OnSockFileSent (ISock * sock, void * context, bool failed) {}
+};
+
+// A connection; valid until its OnSockDisconnect returns
+APICLASS ISock {
+    // Ids are never reused, so they can be held where pointers can't
+    virtual unsigned GetId () const = 0;
+    virtual const sockaddr_in & GetRemoteAddr () const = 0;
+
+    // The data is copied; sends after Disconnect are discarded
+    virtual void Send (const void * data, unsigned bytes) = 0;
+
+    // Takes the chain's slices without copying, leaving it empty
+    virtual void Send (CIoChain * chain) = 0;
+
+    // Sends part of a file with TransmitFile, straight from the system
+    // cache, in order with the other sends. The file must stay open until
+    // OnSockFileSent is called with the context.
+    virtual void SendFile (HANDLE file, u64 offset, unsigned bytes, void * context) = 0;
+
+    // Only valid during OnSockRead: appends part of the data being read to
+    // the chain by referencing the receive buffer rather than copying it
+    virtual void AppendRead (const byte data[], unsigned bytes, CIoChain * chain) = 0;
+
+    // A receive that waits longer than readMs, or a send that takes longer
+    // than sendMs, disconnects the connection; zero means no limit. Use
+    // readMs to reap idle or dead peers and sendMs for peers that stop
+    // reading. Applies from the next receive or send.
+    virtual void SetTimeouts (unsigned readMs, unsigned sendMs) = 0;
+
+    virtual void Disconnect () = 0;
+};
+
+APICLASS ISockListenNotify {
+    // Return the notification interface for the new connection, or NULL
+    // to refuse it
+    virtual ISockNotify * OnSockAccept (const sockaddr_in & remoteAddr) = 0;
+};
+
+APICLASS ISockListener {
+    // The bound port, useful when listening on port zero
+    virtual unsigned GetPort () const = 0;
+
+    // Stop accepting; the listener is deleted once pending accepts finish
+    virtual void Close () = 0;
+};
+
+
+/******************************************************************************
+*
+*   Message framing
+*
+*   Messages are sent with a 32-bit little-endian length prefix. A
+*   CSockFramer, fed from OnSockRead, splits the stream back into messages.
+*   Messages that arrive within one receive are delivered in place from the
+*   receive buffer; a message that spans receives is held by referencing
+*   the receive buffers, and copied once into a pooled buffer when it's
+*   complete.
+*
+*       void OnSockRead (ISock * sock, const byte data[], unsigned bytes) {
+*           if (!m_framer.Read(sock, data, bytes))
+*               sock->Disconnect();
+*       }
+*
+***/
+
+APICLASS ISockMsgNotify {
+    // The message is only valid for the duration of the call
+    virtual void OnSockMsg (ISock * sock, const byte msg[], unsigned bytes) = 0;
+};
+
+class CSockFramer {
+public:
+    CSockFramer (ISockMsgNotify * notify, unsigned maxMsgBytes = 64 * 1024);
+
+    // Returns false if a message is larger than maxMsgBytes, in which case
+    // the stream can't be trusted and the connection should be closed
+    bool Read (ISock * sock, const byte data[], unsigned bytes);
+
+private:
+    ISockMsgNotify *    m_notify;
+    unsigned            m_maxMsgBytes;
+    CIoChain            m_partial;      // message that spans receives, with its header
+
+    bool ReadPartial (ISock * sock, const byte ** data, unsigned * bytes);
+
+    // Hide copy-constructor and assignment operator
+    CSockFramer (const CSockFramer &);
+    CSockFramer & operator= (const CSockFramer &);
+};
+
+// Send a message with its length prefix
+void SockSendMsg (ISock * sock, const void * msg, unsigned bytes);
+
+// As above, taking the chain's slices without copying them
+void SockSendMsg (ISock * sock, CIoChain * msg);
+
+
+/******************************************************************************
+*
+*   UDP endpoints
+*
+*   Each endpoint keeps a number of receives outstanding. Datagrams that
+*   complete during a task thread's batch of completions are delivered
+*   together in one OnUdpRecv call once the batch is done. Unlike TCP
+*   connections, callbacks for one endpoint can run on several threads at
+*   once. Datagrams larger than a pooled buffer (4KB) are dropped.
+*
+***/
+
+struct UdpDatagram {
+    const byte *    data;
+    unsigned        bytes;
+    sockaddr_in     addr;       // source when received, destination when sent
+};
+
+APICLASS IUdpSock;
+
+APICLASS IUdpNotify {
+    // The datagrams are only valid for the duration of the call
+    virtual void OnUdpRecv (IUdpSock * sock, const UdpDatagram datagrams[], unsigned count) = 0;
+
+    // The last callback; the IUdpSock is deleted when this returns
+    virtual void OnUdpClose (IUdpSock * sock) = 0;
+};
+
+APICLASS IUdpSock {
+    virtual unsigned GetPort () const = 0;
+
+    // The data is copied; sends after Close are discarded
+    virtual void Send (const UdpDatagram datagrams[], unsigned count) = 0;
+    virtual void Close () = 0;
+};
+
+
+/******************************************************************************
+*
+*   Functions
+*
+***/
+
+// Module creation/destruction. Call SockDestroy before TaskDestroy,
+// because connections need the task threads to finish closing.
+void SockInitialize ();
+void SockDestroy ();
+
+// Returns false if the address couldn't be bound
+bool SockListen (
+    __in    const sockaddr_in &     addr,
+    __in    ISockListenNotify *     notify,
+    __out   ISockListener **        listener
+);
+
+// Returns false, without calling the notification interface, if a socket
+// couldn't be created; otherwise a failure to connect is reported through
+// OnSockDisconnect
+bool SockConnect (
+    __in    const sockaddr_in &     addr,
+    __in    ISockNotify *           notify
+);
+
+// Send to a connection by id; returns false if it's gone
+bool SockSend (unsigned id, const void * data, unsigned bytes);
+
+// Returns false if the address couldn't be bound
+bool SockUdpOpen (
+    __in    const sockaddr_in &     addr,
+    __in    IUdpNotify *            notify,
+    __out   IUdpSock **             sock
+);
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================
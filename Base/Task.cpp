@@ -18,41 +18,1144 @@
 *
 ***/
 
+// Upper bound on TaskConfig::batchSize; sizes the dequeue buffer on each
+// task thread's stack
+static const unsigned MAX_BATCH_SIZE = 64;
 
-static HANDLE   s_completionPort;
-static long     s_taskThreads;
+// Capacity of each task thread's work deque; must be a power of two.
+// Work posted to a full deque goes to the completion port instead.
+static const unsigned DEQUE_SIZE = 1024;
+static const unsigned DEQUE_MASK = DEQUE_SIZE - 1;
+
+// Most work items a task thread runs before it checks its timers and
+// completion port again, so a stream of posted work can't starve them
+static const unsigned WORK_PASS_MAX = 64;
+
+// Chase-Lev work-stealing deque. The owning thread pushes and pops at
+// the bottom without locking; other threads steal from the top with an
+// interlocked compare-exchange. Indices increase forever and wrap, so
+// only their difference is meaningful.
+struct TaskDeque {
+    volatile long   bottom;
+    byte            pad[64 - sizeof(long)];     // keep owner and thieves off the same cache line
+    volatile long   top;
+    TaskWork *      items[DEQUE_SIZE];
+};
+
+// Histogram bucket 0 counts durations under 1us, bucket n counts
+// [2^(n-1), 2^n) us, and the last bucket counts everything longer
+static const unsigned TIMING_BUCKETS = 24;
+
+// Task types tracked by each thread; must be a power of two. Further
+// types are counted together in an overflow entry.
+static const unsigned TIMING_TYPES = 64;
+
+// Timings for one task type on one thread. Only the owning thread
+// writes them, so recording needs no interlocked operations; readers
+// get approximate values.
+struct TaskTiming {
+    const void * volatile   key;    // type_info or callback address; set last
+    const char *            name;   // class name, or NULL for callbacks
+    u64                     count;
+    u64                     runNs;
+    u64                     waited; // samples that have a queue-wait time
+    u64                     waitNs;
+    u64                     run[TIMING_BUCKETS];
+    u64                     wait[TIMING_BUCKETS];
+};
+
+// Each NUMA node's threads wait on the node's own completion port
+struct TaskNode {
+    HANDLE          port;
+    ULONGLONG       mask;           // processors on the node
+    volatile long   idleThreads;    // threads waiting on the port
+
+    // Admission control; sequence numbers wrap, so only differences count
+    volatile long   posted;         // sequence number of the last work posted
+    volatile long   dequeued;       // work items dequeued from the port
+    volatile long   shedBelow;      // work posted before this is shed
+    volatile long   waiters;        // producers blocked waiting for room
+    HANDLE          roomEvt;        // wakes a blocked producer
+    volatile long   rejected;
+    volatile long   shed;
+};
+
+// Each task thread gets its own cache line so that updating the
+// counters of one thread doesn't contend with the others
+struct __declspec(align(64)) TaskThread {
+    HANDLE      handle;
+    HANDLE      wakeEvt;        // signaled to resume a parked thread
+    HANDLE      port;           // the node's completion port
+    unsigned    node;
+    unsigned    index;
+    unsigned    batchSize;
+
+    // Progress, sampled by the pool controller to find blocked threads.
+    // The count is 32 bits so the controller's reads can't tear; it wraps,
+    // so only differences count.
+    volatile bool   running;    // in a batch of callbacks, not waiting
+    volatile bool   parked;
+    volatile long   dispatched;
+
+    // Owned by the pool controller
+    long        lastDispatched;
+    bool        blocked;
+
+    // Statistics
+    u64         batches;
+    u64         completions;
+    u64         steals;
+
+    TaskDeque   deque;
+    TaskWork *  batchEnd;       // see TaskPostBatchEnd
+    TimerWheel * timers;        // timers owned by this thread
+    TaskTiming  timing[TIMING_TYPES + 1];   // last entry is the overflow
+};
+
+
+static TaskNode *   s_nodes;
+static unsigned     s_nodeCount;
+static volatile long s_nextNode;        // round-robin for unplaced work
+static bool         s_pinThreads;
+static unsigned     s_maxQueuedWork;
+static ETaskOverflow s_overflow;
+static TaskThread * s_taskThreads;      // [s_maxThreads]
+static void *       s_taskThreadMem;    // the allocation s_taskThreads is aligned within
+static volatile unsigned s_taskThreadCount;     // threads started
+static bool         s_workStealing;
+static long         s_idleThreads;     // across all nodes
+
+// Pool controller
+static unsigned     s_minThreads;
+static unsigned     s_maxThreads;
+static unsigned     s_adjustMs;
+static volatile long s_activeThreads;   // started and not parked
+static volatile long s_parkRequests;    // threads asked to park
+static unsigned     s_targetThreads;    // unblocked threads to keep running
+static int          s_climb;            // +1 or -1
+static u64          s_lastThroughput;
+static unsigned     s_blockedThreads;
+
+static bool         s_timing;
+
+static HANDLE       s_monitorThread;
+static HANDLE       s_monitorQuitEvt;
+static unsigned     s_statsDumpMs;
+static FTaskDumpProc s_dumpProc;
+static void *       s_dumpContext;
+
+// The task thread record for the current thread, or NULL
+static __declspec(thread) TaskThread * s_thread;
 
 
 //=============================================================================
-static unsigned __stdcall TaskThreadProc (void *) {
-    DebugSetThreadName("Task");
+static unsigned GetProcessorCount () {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+}
+
+//=============================================================================
+// Returns the mask with only the nth (modulo the bit count) set bit of "mask"
+static ULONGLONG GetNthProcessor (ULONGLONG mask, unsigned n) {
+    unsigned bits = 0;
+    for (ULONGLONG m = mask; m; m &= m - 1)
+        ++bits;
+
+    n %= bits;
+    for (; n; --n)
+        mask &= mask - 1;
+    return mask & ~(mask - 1);
+}
+
+//=============================================================================
+// Unplaced work and handles are spread over the nodes; work from a task
+// thread stays on its node
+static unsigned PickNode () {
+    if (s_thread)
+        return s_thread->node;
+    return (unsigned) InterlockedIncrement(&s_nextNode) % s_nodeCount;
+}
+
+
+/******************************************************************************
+*
+*   Completion port
+*
+*   These functions are the only part of the task module that talks to the
+*   operating system's completion queue; everything else is written in terms
+*   of them so the dispatcher doesn't depend on how completions are queued.
+*
+***/
+
+//=============================================================================
+static HANDLE PortCreate (unsigned concurrency) {
+    HANDLE port;
+    if (NULL == (port = CreateIoCompletionPort(
+        INVALID_HANDLE_VALUE,
+        NULL,
+        NULL,
+        concurrency
+    ))) {
+        LOG_OS_LAST_ERROR(L"CreateIoCompletionPort");
+        FatalError();
+    }
+    return port;
+}
+
+//=============================================================================
+static void PortDestroy (HANDLE port) {
+    CloseHandle(port);
+}
+
+//=============================================================================
+static void PortAssociate (HANDLE port, HANDLE handle, CTask * task) {
+    if (!CreateIoCompletionPort(handle, port, (ULONG_PTR) task, 0)) {
+        LOG_OS_LAST_ERROR(L"CreateIoCompletionPort");
+        FatalError();
+    }
+
+    // Completions are only ever consumed through the port, so don't make
+    // the kernel signal the handle's internal event after every operation.
+    // This is an optimization only; it's okay if the handle doesn't support it.
+    (void) SetFileCompletionNotificationModes(handle, FILE_SKIP_SET_EVENT_ON_HANDLE);
+}
+
+//=============================================================================
+static void PortPost (
+    HANDLE          port,
+    CTask *         task,
+    unsigned        bytes,
+    OVERLAPPED *    olap
+) {
+    if (!PostQueuedCompletionStatus(port, bytes, (ULONG_PTR) task, olap)) {
+        LOG_OS_LAST_ERROR(L"PostQueuedCompletionStatus");
+        FatalError();
+    }
+}
+
+//=============================================================================
+// Dequeues up to "count" completions with a single kernel transition and
+// returns the number dequeued. Failed I/O operations are returned too so
+// the task can clean up (e.g. after its handle was closed); the status is
+// in the entry's OVERLAPPED. Returns zero if the wait times out or is
+// interrupted by an APC, which is how timers are serviced.
+static unsigned PortWait (
+    HANDLE              port,
+    OVERLAPPED_ENTRY    entries[],
+    unsigned            count,
+    unsigned            timeoutMs
+) {
+    ULONG dequeued;
+    if (!GetQueuedCompletionStatusEx(
+        port,
+        entries,
+        count,
+        &dequeued,
+        timeoutMs,
+        true        // alertable
+    )) {
+        DWORD error = GetLastError();
+        if (error != WAIT_TIMEOUT && error != WAIT_IO_COMPLETION)
+            LOG_OS_ERROR(L"GetQueuedCompletionStatusEx", error);
+        return 0;
+    }
+    return dequeued;
+}
+
+//=============================================================================
+static inline CTask * PortEntryTask (const OVERLAPPED_ENTRY & entry) {
+    return (CTask *) entry.lpCompletionKey;
+}
+
+
+/******************************************************************************
+*
+*   Timing
+*
+***/
+
+//=============================================================================
+static inline u64 TimingNow () {
+    return TimeGetNs();
+}
+
+//=============================================================================
+static unsigned TimingBucket (u64 ns) {
+    u64 us = ns / 1000;
+    unsigned bucket = 0;
+    while (us && bucket < TIMING_BUCKETS - 1) {
+        us >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+//=============================================================================
+// Finds the calling thread's entry for a task type, adding it if needed.
+// "task" names the entry; it's NULL when the key is a callback address.
+static TaskTiming * TimingFind (
+    TaskThread *    thread,
+    const void *    key,
+    const CTask *   task
+) {
+    unsigned hash = (unsigned) ((size_t) key >> 4);
+    for (unsigned i = 0; i < TIMING_TYPES; ++i) {
+        TaskTiming * timing = &thread->timing[(hash + i) & (TIMING_TYPES - 1)];
+        if (timing->key == key)
+            return timing;
+
+        if (!timing->key) {
+            timing->name = task ? typeid(*task).name() : NULL;
+            _WriteBarrier();
+            timing->key = key;
+            return timing;
+        }
+    }
+    return &thread->timing[TIMING_TYPES];
+}
+
+//=============================================================================
+// "queued" is zero if the time the completion was queued isn't known
+static void TimingRecord (
+    TaskTiming *    timing,
+    u64             queued,
+    u64             start,
+    u64             end
+) {
+    timing->count       += 1;
+    timing->runNs    += end - start;
+    timing->run[TimingBucket(end - start)] += 1;
+
+    if (queued) {
+        timing->waited      += 1;
+        timing->waitNs   += start - queued;
+        timing->wait[TimingBucket(start - queued)] += 1;
+    }
+}
+
+//=============================================================================
+// Returns the upper bound in microseconds of the bucket that contains
+// the given fraction of samples
+static unsigned TimingPercentile (
+    const u64   buckets[],
+    u64         count,
+    double      fraction
+) {
+    u64 target = (u64) (count * fraction);
+    u64 seen   = 0;
+    unsigned bucket = 0;
+    for (; bucket < TIMING_BUCKETS - 1; ++bucket) {
+        seen += buckets[bucket];
+        if (seen > target)
+            break;
+    }
+    return 1u << bucket;
+}
+
+//=============================================================================
+static void TimingDumpHistogram (
+    char *          buf,
+    size_t          chars,
+    const u64       buckets[],
+    u64             count,
+    u64             ns
+) {
+    if (!count) {
+        StrPrintf(buf, chars, "%8s %7s %7s %7s", "-", "-", "-", "-");
+        return;
+    }
+
+    StrPrintf(
+        buf,
+        chars,
+        "%8.1f %7u %7u %7u",
+        (double) ns / 1000.0 / (double) count,
+        TimingPercentile(buckets, count, 0.5),
+        TimingPercentile(buckets, count, 0.99),
+        TimingPercentile(buckets, count, 0.999)
+    );
+}
+
+//=============================================================================
+static void DebugDumpProc (void *, const char line[]) {
+    DebugMsg("%s\n", line);
+}
+
+
+/******************************************************************************
+*
+*   Posted work
+*
+*   Work posted from outside the task threads travels through the completion
+*   port as the OVERLAPPED pointer of a completion addressed to s_workTask,
+*   so posting needs no allocation. A completion for s_workTask without a
+*   work item is a wakeup telling an idle thread there is work to steal.
+*
+*   Work posted by a task callback goes onto the posting thread's own deque
+*   instead, where it stays cache-local unless an idle thread steals it.
+*
+***/
+
+class CWorkTask : public CTask {
+    void TaskComplete (unsigned bytes, OVERLAPPED * olap);
+};
+
+static CWorkTask s_workTask;
+
+
+//=============================================================================
+static void RunWork (TaskWork * work) {
+    TaskThread * thread = s_thread;
+    thread->dispatched += 1;
+    if (!s_timing) {
+        work->proc(work->context);
+        return;
+    }
+
+    // The callback may reuse or free the work item
+    TaskTiming * timing = TimingFind(thread, work->proc, NULL);
+    u64 posted = work->postTime;
+    u64 start  = TimingNow();
+    work->proc(work->context);
+    TimingRecord(timing, posted, start, TimingNow());
+}
+
+//=============================================================================
+void CWorkTask::TaskComplete (unsigned, OVERLAPPED * olap) {
+    TaskWork * work = (TaskWork *) olap;
+    if (!work)
+        return;
+
+    TaskNode * node = &s_nodes[s_thread->node];
+    bool shed = s_maxQueuedWork
+        && s_overflow == TASK_OVERFLOW_SHED_OLDEST
+        && (long) ((unsigned long) work->seq - (unsigned long) node->shedBelow) < 0;
+    InterlockedIncrement(&node->dequeued);
+
+    // Pairs with the waiter count in AdmitWork
+    if (node->waiters)
+        SetEvent(node->roomEvt);
+
+    if (!shed) {
+        RunWork(work);
+        return;
+    }
+
+    InterlockedIncrement(&node->shed);
+    if (work->shedProc)
+        work->shedProc(work->context);
+}
+
+//=============================================================================
+static void WakeIdleThread () {
+    // Pairs with the idle check in TaskThreadProc: either the idle thread
+    // sees the new work when it looks again, or we see it idle
+    MemoryBarrier();
+    if (!s_idleThreads)
+        return;
+
+    // Prefer a thread on this node, where the work's data probably is
+    unsigned first = s_thread ? s_thread->node : 0;
+    for (unsigned i = 0; i < s_nodeCount; ++i) {
+        TaskNode * node = &s_nodes[(first + i) % s_nodeCount];
+        if (node->idleThreads) {
+            PortPost(node->port, &s_workTask, 0, NULL);
+            return;
+        }
+    }
+}
+
+//=============================================================================
+static inline long QueueDepth (const TaskNode * node) {
+    return (long) ((unsigned long) node->posted - (unsigned long) node->dequeued);
+}
 
+//=============================================================================
+// Assigns the work's sequence number on the node, applying the overflow
+// policy. Returns false if the work must not be queued.
+static bool AdmitWork (TaskNode * node, TaskWork * work) {
+    long max = (long) s_maxQueuedWork;
+    if (!max) {
+        work->seq = InterlockedIncrement(&node->posted);
+        return true;
+    }
+
+    switch (s_overflow) {
+        case TASK_OVERFLOW_REJECT:
+            // A race may admit a few extra items; that's fine for a limit
+            // meant to keep latency bounded
+            if (QueueDepth(node) >= max) {
+                InterlockedIncrement(&node->rejected);
+                return false;
+            }
+        break;
+
+        case TASK_OVERFLOW_BLOCK:
+            if (s_thread || QueueDepth(node) < max)
+                break;
+
+            // Count ourselves as waiting before checking again, so the
+            // dequeuing thread either sees us or we see its progress
+            InterlockedIncrement(&node->waiters);
+            while (QueueDepth(node) >= max)
+                WaitForSingleObject(node->roomEvt, INFINITE);
+            InterlockedDecrement(&node->waiters);
+        break;
+
+        case TASK_OVERFLOW_SHED_OLDEST: {
+            // Work already in the port can't be removed, so the watermark
+            // keeps only the newest "max" items, this one included; anything
+            // older that's still queued when dequeued is dropped
+            work->seq = InterlockedIncrement(&node->posted);
+            long shedBelow = (long) ((unsigned long) work->seq - (unsigned long) max + 1);
+            for (;;) {
+                long current = node->shedBelow;
+                if ((long) ((unsigned long) shedBelow - (unsigned long) current) <= 0)
+                    break;
+                if (InterlockedCompareExchange(&node->shedBelow, shedBelow, current) == current)
+                    break;
+            }
+        }
+        return true;
+    }
+
+    work->seq = InterlockedIncrement(&node->posted);
+    return true;
+}
+
+//=============================================================================
+static bool DequePush (TaskDeque * deque, TaskWork * work) {
+    long bottom = deque->bottom;
+    long size   = (long) ((unsigned long) bottom - (unsigned long) deque->top);
+    if (size >= (long) DEQUE_SIZE)
+        return false;
+
+    deque->items[bottom & DEQUE_MASK] = work;
+    _WriteBarrier();
+    deque->bottom = (long) ((unsigned long) bottom + 1);
+
+    // Only the first item needs a wakeup; thieves wake each other
+    // while work remains (see StealWork)
+    if (!size)
+        WakeIdleThread();
+    return true;
+}
+
+//=============================================================================
+static TaskWork * DequePop (TaskDeque * deque) {
+    long bottom = (long) ((unsigned long) deque->bottom - 1);
+    deque->bottom = bottom;
+    MemoryBarrier();
+    long top = deque->top;
+
+    long size = (long) ((unsigned long) bottom - (unsigned long) top);
+    if (size < 0) {
+        // Empty
+        deque->bottom = top;
+        return NULL;
+    }
+
+    TaskWork * work = deque->items[bottom & DEQUE_MASK];
+    if (size > 0)
+        return work;
+
+    // Last item; race any thieves for it
+    if (InterlockedCompareExchange(&deque->top, (long) ((unsigned long) top + 1), top) != top)
+        work = NULL;
+    deque->bottom = (long) ((unsigned long) top + 1);
+    return work;
+}
+
+//=============================================================================
+static TaskWork * DequeSteal (TaskDeque * deque, bool * more) {
+    long top = deque->top;
+    _ReadBarrier();
+    long bottom = deque->bottom;
+
+    long size = (long) ((unsigned long) bottom - (unsigned long) top);
+    if (size <= 0)
+        return NULL;
+
+    TaskWork * work = deque->items[top & DEQUE_MASK];
+    if (InterlockedCompareExchange(&deque->top, (long) ((unsigned long) top + 1), top) != top)
+        return NULL;
+
+    *more = size > 1;
+    return work;
+}
+
+//=============================================================================
+static TaskWork * StealWork (TaskThread * thread) {
+    unsigned count = s_taskThreadCount;
+    for (unsigned i = 1; i < count; ++i) {
+        TaskThread * victim = &s_taskThreads[(thread->index + i) % count];
+        bool more = false;
+        if (TaskWork * work = DequeSteal(&victim->deque, &more)) {
+            thread->steals += 1;
+
+            // Pass the wakeup along so other idle threads help too
+            if (more)
+                WakeIdleThread();
+            return work;
+        }
+    }
+    return NULL;
+}
+
+//=============================================================================
+static void RunBatchEnd (TaskThread * thread) {
+    // Callbacks may queue more batch-end work
+    while (TaskWork * work = thread->batchEnd) {
+        thread->batchEnd = NULL;
+        while (work) {
+            TaskWork * next = work->next;
+            RunWork(work);
+            work = next;
+        }
+    }
+}
+
+//=============================================================================
+// Runs work from the thread's own deque; returns true if work may remain
+// after running WORK_PASS_MAX items. Other threads' work is only stolen
+// once the thread's own batch-end work has run.
+static bool RunPendingWork (TaskThread * thread) {
+    for (unsigned i = 0; i < WORK_PASS_MAX; ++i) {
+        TaskWork * work = DequePop(&thread->deque);
+        if (!work)
+            return false;
+        RunWork(work);
+    }
+    return true;
+}
+
+
+/******************************************************************************
+*
+*   Operations
+*
+*   Handles registered with TaskRegisterOpHandle all share s_opTask, which
+*   forwards each completion to the TaskOp containing its OVERLAPPED.
+*
+***/
+
+class COpTask : public CTask {
+    void TaskComplete (unsigned bytes, OVERLAPPED * olap);
+};
+
+static COpTask      s_opTask;
+static CMemPool *   s_opPool;
+
+
+//=============================================================================
+void COpTask::TaskComplete (unsigned bytes, OVERLAPPED * olap) {
+    TaskOp * op = (TaskOp *) ((byte *) olap - offsetof(TaskOp, olap));
+    s_thread->dispatched += 1;
+    if (!s_timing) {
+        op->proc(op, bytes);
+        return;
+    }
+
+    // The callback usually frees the op
+    TaskTiming * timing = TimingFind(s_thread, op->proc, NULL);
+    u64 issued = op->issueTime;
+    u64 start  = TimingNow();
+    op->proc(op, bytes);
+    TimingRecord(timing, issued, start, TimingNow());
+}
+
+
+/******************************************************************************
+*
+*   Deadlines
+*
+*   Armed deadlines are spread across several lists so that operations
+*   completing on different threads rarely contend for a lock. The monitor
+*   thread sweeps the lists and cancels the operations that are overdue;
+*   cancelling while holding the list lock means TaskDeadlineClear can't
+*   return while a cancel of the old operation is still to come.
+*
+***/
+
+static const unsigned DEADLINE_SHARDS = 16;
+
+// How often the monitor thread checks deadlines
+static const unsigned DEADLINE_SWEEP_MS = 100;
+
+struct DeadlineShard {
+    CCritSect                           critsect;
+    LIST_DECLARE(TaskDeadline, link)    list;
+};
+
+static DeadlineShard s_deadlines[DEADLINE_SHARDS];
+
+
+//=============================================================================
+static inline DeadlineShard * DeadlineGetShard (const TaskDeadline * deadline) {
+    // Deadlines are embedded in larger objects, so skip the low bits
+    return &s_deadlines[((size_t) deadline >> 6) % DEADLINE_SHARDS];
+}
+
+//=============================================================================
+static void DeadlineSweep () {
+    unsigned now = TimeGetCoarseMs();
+    for (unsigned i = 0; i < DEADLINE_SHARDS; ++i) {
+        DeadlineShard * shard = &s_deadlines[i];
+        shard->critsect.Enter();
+        TaskDeadline * next;
+        for (TaskDeadline * deadline = shard->list.Head(); deadline; deadline = next) {
+            next = shard->list.Next(deadline);
+            if ((int) (now - deadline->expireMs) < 0)
+                continue;
+
+            // The operation completes with an error and its owner clears
+            // the deadline, which is already unlinked
+            deadline->link.Unlink();
+            CancelIoEx(deadline->handle, deadline->olap);
+        }
+        shard->critsect.Leave();
+    }
+}
+
+
+/******************************************************************************
+*
+*   Parallel loops
+*
+*   A loop is split into sub-ranges that are claimed with an interlocked
+*   counter. Helper work items are posted to claim sub-ranges alongside the
+*   calling thread; because the caller keeps claiming until none are left it
+*   never depends on a helper being scheduled, which is what makes nested
+*   loops safe. Helpers that run after the loop has finished find nothing to
+*   claim, so the loop record is reference-counted rather than living on the
+*   caller's stack.
+*
+***/
+
+struct ParallelFor {
+    FTaskForProc    proc;
+    void *          context;
+    unsigned        begin;
+    unsigned        end;
+    unsigned        grain;
+    unsigned        ranges;
+    volatile long   nextRange;
+    volatile long   doneRanges;
+    volatile long   refs;
+    TaskWork        helpers[1];     // actually [helperCount]
+};
+
+
+//=============================================================================
+static void ParallelForRelease (ParallelFor * loop) {
+    if (!InterlockedDecrement(&loop->refs))
+        MemFree(loop);
+}
+
+//=============================================================================
+static void ParallelForRun (ParallelFor * loop) {
     for (;;) {
-        // Get the next task completion
-        DWORD bytes;
-        DWORD key;
-        OVERLAPPED * olap;
-        if (!GetQueuedCompletionStatus(
-            s_completionPort,
-            &bytes,
-            &key,
-            &olap,
-            INFINITE
-        )) {
-            LOG_OS_LAST_ERROR(L"GetQueuedCompletionStatus");
+        unsigned range = (unsigned) InterlockedIncrement(&loop->nextRange) - 1;
+        if (range >= loop->ranges)
+            break;
+
+        unsigned first = loop->begin + range * loop->grain;
+        unsigned last  = (loop->end - first > loop->grain) ? first + loop->grain : loop->end;
+        loop->proc(loop->context, first, last);
+        InterlockedIncrement(&loop->doneRanges);
+    }
+}
+
+//=============================================================================
+static void ParallelForShedProc (void * context) {
+    ParallelForRelease((ParallelFor *) context);
+}
+
+//=============================================================================
+static void ParallelForHelperProc (void * context) {
+    ParallelFor * loop = (ParallelFor *) context;
+    ParallelForRun(loop);
+    ParallelForRelease(loop);
+}
+
+
+/******************************************************************************
+*
+*   Task threads
+*
+***/
+
+//=============================================================================
+static void Dispatch (
+    TaskThread *                thread,
+    CTask *                     task,
+    const OVERLAPPED_ENTRY &    entry
+) {
+    // Internal tasks count and time the callbacks they forward to
+    bool internal = task == &s_workTask || task == &s_opTask;
+    if (!internal)
+        thread->dispatched += 1;
+    if (!s_timing || internal) {
+        task->TaskComplete(entry.dwNumberOfBytesTransferred, entry.lpOverlapped);
+        return;
+    }
+
+    // Look the type up first because the task may delete itself
+    const std::type_info & type = typeid(*task);
+    TaskTiming * timing = TimingFind(thread, &type, task);
+    u64 start = TimingNow();
+    task->TaskComplete(entry.dwNumberOfBytesTransferred, entry.lpOverlapped);
+    TimingRecord(timing, 0, start, TimingNow());
+}
+
+//=============================================================================
+// Called by a task thread with an empty deque. Returns true once the
+// thread has been parked and woken again.
+static bool ThreadTryPark (TaskThread * thread) {
+    for (;;) {
+        long requests = s_parkRequests;
+        if (requests <= 0)
+            return false;
+        if (InterlockedCompareExchange(&s_parkRequests, requests - 1, requests) == requests)
+            break;
+    }
+
+    // The controller clears "parked" before waking the thread. Timers
+    // owned by the thread still fire while it's parked.
+    thread->parked = true;
+    InterlockedDecrement(&s_activeThreads);
+    bool more = false;
+    while (WAIT_OBJECT_0 != WaitForSingleObjectEx(
+        thread->wakeEvt,
+        more ? 0 : TimerWheelSleepMs(thread->timers),
+        true        // alertable
+    )) {
+        TimerWheelRun(thread->timers);
+        more = RunPendingWork(thread);
+        RunBatchEnd(thread);
+    }
+    return true;
+}
+
+//=============================================================================
+static unsigned __stdcall TaskThreadProc (void * param) {
+    DebugSetThreadName("Task");
+    TaskThread * thread = (TaskThread *) param;
+    s_thread = thread;
+
+    unsigned quits = 0;
+    while (!quits) {
+        // Fire due timers, then run a pass of the work posted by callbacks
+        // and the batch-end work they queued, such as coalesced sends
+        thread->running = true;
+        TimerWheelRun(thread->timers);
+        bool more = RunPendingWork(thread);
+        RunBatchEnd(thread);
+        thread->running = false;
+
+        OVERLAPPED_ENTRY entries[MAX_BATCH_SIZE];
+        unsigned count;
+        if (more) {
+            // Pick up any completions without waiting, then carry on
+            count = PortWait(thread->port, entries, thread->batchSize, 0);
+        }
+        else {
+            // Leave the pool if the controller has too many threads running
+            if (s_parkRequests > 0 && ThreadTryPark(thread))
+                continue;
+
+            // Advertise that this thread is idle, then look for work once
+            // more so a thread that posted before seeing us idle isn't
+            // missed. Completions come before stolen work.
+            TaskNode * node = &s_nodes[thread->node];
+            InterlockedIncrement(&node->idleThreads);
+            InterlockedIncrement(&s_idleThreads);
+            count = 0;
+            if (s_workStealing) {
+                count = PortWait(thread->port, entries, thread->batchSize, 0);
+                if (!count) {
+                    if (TaskWork * work = StealWork(thread)) {
+                        InterlockedDecrement(&s_idleThreads);
+                        InterlockedDecrement(&node->idleThreads);
+                        thread->running = true;
+                        RunWork(work);
+                        RunBatchEnd(thread);
+                        continue;
+                    }
+                }
+            }
+
+            // Get the next batch of task completions
+            if (!count) {
+                count = PortWait(
+                    thread->port,
+                    entries,
+                    thread->batchSize,
+                    TimerWheelSleepMs(thread->timers)
+                );
+            }
+            InterlockedDecrement(&s_idleThreads);
+            InterlockedDecrement(&node->idleThreads);
+        }
+        if (!count)
             continue;
+
+        thread->running      = true;
+        thread->batches     += 1;
+        thread->completions += count;
+
+        // Dispatch events
+        for (unsigned i = 0; i < count; ++i) {
+            // If the task is NULL this is a thread-quit notification; finish
+            // the rest of the batch because it was removed from the port
+            CTask * task = PortEntryTask(entries[i]);
+            if (!task) {
+                ++quits;
+                continue;
+            }
+
+            Dispatch(thread, task, entries[i]);
         }
+        thread->running = false;
+    }
 
-        // If the task is NULL this is a thread-quit notification
-        if (!key)
-            break;
+    // Each thread must consume exactly one quit notification; hand back
+    // any extras that were dequeued in the same batch
+    while (--quits)
+        PortPost(thread->port, NULL, 0, NULL);
+
+    // Don't abandon work this thread's callbacks posted
+    while (TaskWork * work = DequePop(&thread->deque))
+        RunWork(work);
+    RunBatchEnd(thread);
+
+    s_thread = NULL;
+    return 0;
+}
 
-        // Dispatch event
-        CTask * task = (CTask *) key;
-        task->TaskComplete(bytes, olap);
+
+//=============================================================================
+static void ThreadStart (TaskThread * thread, unsigned index, unsigned batchSize) {
+    // Deal threads out across the nodes
+    const TaskNode & node   = s_nodes[index % s_nodeCount];
+    thread->port            = node.port;
+    thread->node            = index % s_nodeCount;
+    thread->index           = index;
+    thread->batchSize       = batchSize;
+    thread->running         = false;
+    thread->parked          = false;
+    thread->dispatched      = 0;
+    thread->lastDispatched  = 0;
+    thread->blocked         = false;
+    thread->batches         = 0;
+    thread->completions     = 0;
+    thread->steals          = 0;
+    thread->batchEnd        = NULL;
+    thread->deque.bottom    = 0;
+    thread->deque.top       = 0;
+    ZERO(thread->timing);
+    if (NULL == (thread->wakeEvt = CreateEvent(NULL, false, false, NULL))) {
+        LOG_OS_LAST_ERROR(L"CreateEvent");
+        FatalError();
+    }
+
+    unsigned threadId;
+    if (NULL == (thread->handle = (HANDLE) _beginthreadex(
+        (LPSECURITY_ATTRIBUTES) NULL,
+        0,      // default stack size
+        TaskThreadProc,
+        thread,
+        CREATE_SUSPENDED,
+        &threadId
+    ))) {
+        LOG_OS_LAST_ERROR(L"_beginthreadex");
+        FatalError();
+    }
+    thread->timers = TimerWheelCreate(thread->handle);
+
+    // Set affinity before the thread runs so its stack and the memory it
+    // touches first are allocated on its node
+    ULONGLONG affinity = 0;
+    if (s_pinThreads)
+        affinity = GetNthProcessor(node.mask, index / s_nodeCount);
+    else if (s_nodeCount > 1)
+        affinity = node.mask;
+    if (affinity && !SetThreadAffinityMask(thread->handle, (DWORD_PTR) affinity))
+        LOG_OS_LAST_ERROR(L"SetThreadAffinityMask");
+
+    ResumeThread(thread->handle);
+}
+
+
+//=============================================================================
+static void NodesCreate (bool numaAware, unsigned concurrency) {
+    DWORD_PTR processMask;
+    DWORD_PTR systemMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        LOG_OS_LAST_ERROR(L"GetProcessAffinityMask");
+        FatalError();
+    }
+
+    ULONG highest = 0;
+    if (numaAware && !GetNumaHighestNodeNumber(&highest))
+        highest = 0;
+
+    // Only nodes with processors this process can use get a port
+    s_nodes = new TaskNode[highest + 1];
+    s_nodeCount = 0;
+    for (ULONG number = 0; number <= highest; ++number) {
+        ULONGLONG mask = processMask;
+        if (highest) {
+            if (!GetNumaNodeProcessorMask((UCHAR) number, &mask))
+                continue;
+            mask &= processMask;
+        }
+        if (!mask)
+            continue;
+
+        TaskNode * node     = &s_nodes[s_nodeCount++];
+        node->port          = PortCreate(concurrency);
+        node->mask          = mask;
+        node->idleThreads   = 0;
+        node->posted        = 0;
+        node->dequeued      = 0;
+        node->shedBelow     = 0;
+        node->waiters       = 0;
+        node->rejected      = 0;
+        node->shed          = 0;
+        if (NULL == (node->roomEvt = CreateEvent(NULL, false, false, NULL))) {
+            LOG_OS_LAST_ERROR(L"CreateEvent");
+            FatalError();
+        }
     }
+    ASSERT(s_nodeCount);
+}
+
+//=============================================================================
+static void NodesDestroy () {
+    for (unsigned i = 0; i < s_nodeCount; ++i) {
+        PortDestroy(s_nodes[i].port);
+        CloseHandle(s_nodes[i].roomEvt);
+    }
+    delete [] s_nodes;
+    s_nodes = NULL;
+    s_nodeCount = 0;
+}
+
+
+/******************************************************************************
+*
+*   Pool controller
+*
+*   Runs on the monitor thread every s_adjustMs. A thread that has been in
+*   the same batch of callbacks for a whole interval without finishing one
+*   is counted as blocked, and a thread is added to replace it. The number
+*   of unblocked threads is hill-climbed: while every thread is busy the
+*   target moves one step at a time, reversing direction whenever
+*   throughput drops. When threads sit idle the target shrinks instead.
+*   Extra threads are parked rather than exited so their records stay valid
+*   for thieves.
+*
+***/
+
+//=============================================================================
+static void ControllerAddThread () {
+    for (unsigned i = 0; i < s_taskThreadCount; ++i) {
+        TaskThread * thread = &s_taskThreads[i];
+        if (thread->parked) {
+            thread->parked = false;
+            InterlockedIncrement(&s_activeThreads);
+            SetEvent(thread->wakeEvt);
+            return;
+        }
+    }
+
+    // Fill in the record before publishing it to thieves
+    unsigned index = s_taskThreadCount;
+    ASSERT(index < s_maxThreads);
+    InterlockedIncrement(&s_activeThreads);
+    ThreadStart(&s_taskThreads[index], index, s_taskThreads[0].batchSize);
+    MemoryBarrier();
+    s_taskThreadCount = index + 1;
+}
+
+//=============================================================================
+static void ControllerAdjust () {
+    // Find threads stuck in a callback since the last sample
+    u64 dispatched = 0;
+    unsigned blocked = 0;
+    for (unsigned i = 0; i < s_taskThreadCount; ++i) {
+        TaskThread * thread = &s_taskThreads[i];
+        long count = thread->dispatched;
+        bool stuck = thread->running && count == thread->lastDispatched;
+        thread->blocked = stuck && thread->blocked;
+        if (thread->blocked)
+            ++blocked;
+        else
+            thread->blocked = stuck;    // blocked if still stuck next time
+
+        dispatched += (unsigned long) count - (unsigned long) thread->lastDispatched;
+        thread->lastDispatched = count;
+    }
+    s_blockedThreads = blocked;
+
+    // Climb while saturated; give threads back while there's idle capacity
+    if (s_idleThreads > 1) {
+        if (s_targetThreads > s_minThreads)
+            --s_targetThreads;
+    }
+    else if (!s_idleThreads) {
+        if (dispatched < s_lastThroughput - s_lastThroughput / 20)
+            s_climb = -s_climb;
+        if (s_climb > 0 && s_targetThreads < s_maxThreads)
+            ++s_targetThreads;
+        else if (s_climb < 0 && s_targetThreads > s_minThreads)
+            --s_targetThreads;
+    }
+    s_lastThroughput = dispatched;
 
-    InterlockedDecrement(&s_taskThreads);
+    unsigned desired = s_targetThreads + blocked;
+    if (desired > s_maxThreads)
+        desired = s_maxThreads;
+
+    // Pending park requests count against the active threads
+    long active = s_activeThreads - s_parkRequests;
+    if (active < (long) desired) {
+        // Cancel park requests first, then wake or start threads
+        for (; active < (long) desired; ++active) {
+            long requests = s_parkRequests;
+            if (requests > 0 && InterlockedCompareExchange(&s_parkRequests, requests - 1, requests) == requests)
+                continue;
+            ControllerAddThread();
+        }
+    }
+    else if (active > (long) desired) {
+        InterlockedExchangeAdd(&s_parkRequests, active - (long) desired);
+    }
+}
+
+//=============================================================================
+static unsigned __stdcall MonitorThreadProc (void *) {
+    DebugSetThreadName("TaskMonitor");
+    unsigned interval = DEADLINE_SWEEP_MS;
+    if (s_adjustMs && s_adjustMs < interval)
+        interval = s_adjustMs;
+    unsigned lastAdjustMs = TimeGetMs();
+    unsigned lastDumpMs = lastAdjustMs;
+    while (WAIT_TIMEOUT == WaitForSingleObject(s_monitorQuitEvt, interval)) {
+        DeadlineSweep();
+
+        if (s_adjustMs && TimeGetMs() - lastAdjustMs >= s_adjustMs) {
+            lastAdjustMs = TimeGetMs();
+            ControllerAdjust();
+        }
+
+        if (s_statsDumpMs && TimeGetMs() - lastDumpMs >= s_statsDumpMs) {
+            lastDumpMs = TimeGetMs();
+            TaskDumpStats(s_dumpProc ? s_dumpProc : DebugDumpProc, s_dumpContext);
+        }
+    }
     return 0;
 }
 
@@ -63,24 +1166,92 @@ static unsigned __stdcall TaskThreadProc (void *) {
 *
 ***/
 
+//=============================================================================
+TaskConfig::TaskConfig ()
+:   threads(0)
+,   minThreads(0)
+,   maxThreads(0)
+,   adjustMs(500)
+,   batchSize(16)
+,   workStealing(true)
+,   maxQueuedWork(0)
+,   overflow(TASK_OVERFLOW_REJECT)
+,   numaAware(false)
+,   pinThreads(false)
+,   timing(true)
+,   statsDumpMs(0)
+,   dumpProc(NULL)
+,   dumpContext(NULL)
+{}
+
 //=============================================================================
 void TaskInitialize () {
-    if (NULL == (s_completionPort = CreateIoCompletionPort(
-        INVALID_HANDLE_VALUE,
-        NULL,
-        NULL,
-        0
-    ))) {
-        LOG_OS_LAST_ERROR(L"CreateIoCompletionPort");
-        FatalError();
+    TaskInitialize(TaskConfig());
+}
+
+//=============================================================================
+void TaskInitialize (const TaskConfig & config) {
+    ASSERT(!s_taskThreads);
+    TimeInitialize();
+    unsigned threads = config.threads ? config.threads : GetProcessorCount();
+    unsigned batchSize = config.batchSize;
+    if (batchSize < 1)
+        batchSize = 1;
+    else if (batchSize > MAX_BATCH_SIZE)
+        batchSize = MAX_BATCH_SIZE;
+
+    unsigned minThreads = config.minThreads ? config.minThreads : threads;
+    unsigned maxThreads = config.maxThreads ? config.maxThreads : threads;
+    if (minThreads > threads)
+        minThreads = threads;
+    if (maxThreads < threads)
+        maxThreads = threads;
+
+    // The controller decides how many threads run, so don't let the
+    // ports hold any of them back
+    NodesCreate(config.numaAware, maxThreads);
+    s_pinThreads     = config.pinThreads;
+    s_maxQueuedWork  = config.maxQueuedWork;
+    s_overflow       = config.overflow;
+    s_workStealing   = config.workStealing;
+    s_opPool         = new CMemPool(sizeof(TaskOp), 256);
+    s_timing         = config.timing;
+
+    // Records for threads the controller may add later are allocated
+    // now, so thieves can index the array without locking. The heap only
+    // aligns to 8 or 16 bytes, so align the records to cache lines here.
+    const size_t align  = __alignof(TaskThread);
+    s_taskThreadMem     = ALLOC(sizeof(TaskThread) * maxThreads + align - 1);
+    s_taskThreads       = (TaskThread *) (((size_t) s_taskThreadMem + align - 1) & ~(align - 1));
+    s_minThreads        = minThreads;
+    s_maxThreads        = maxThreads;
+    s_adjustMs          = maxThreads > minThreads ? config.adjustMs : 0;
+    s_targetThreads     = threads;
+    s_climb             = 1;
+    s_lastThroughput    = 0;
+    s_blockedThreads    = 0;
+    s_activeThreads     = (long) threads;
+    s_parkRequests      = 0;
+
+    // Threads start stealing as soon as they run; the count published
+    // to them must not include records still being filled in
+    for (unsigned i = 0; i < threads; ++i) {
+        ThreadStart(&s_taskThreads[i], i, batchSize);
+        MemoryBarrier();
+        s_taskThreadCount = i + 1;
     }
 
-    HANDLE thread;
+    // The monitor always runs because it checks deadlines
+    s_statsDumpMs   = config.statsDumpMs;
+    s_dumpProc      = config.dumpProc;
+    s_dumpContext   = config.dumpContext;
+    s_monitorQuitEvt = CreateEvent(NULL, true, false, NULL);
+
     unsigned threadId;
-    if (NULL == (thread = (HANDLE) _beginthreadex(
+    if (NULL == (s_monitorThread = (HANDLE) _beginthreadex(
         (LPSECURITY_ATTRIBUTES) NULL,
         0,      // default stack size
-        TaskThreadProc,
+        MonitorThreadProc,
         NULL,
         0,      // flags
         &threadId
@@ -88,36 +1259,365 @@ void TaskInitialize () {
         LOG_OS_LAST_ERROR(L"_beginthreadex");
         FatalError();
     }
-    CloseHandle(thread);    // TODO: Keep in an array and use instead of sleeping on s_taskThreads on exit
-    InterlockedIncrement(&s_taskThreads);
 }
 
 //=============================================================================
 void TaskDestroy () {
-    while (volatile long count = s_taskThreads) {
-        PostQueuedCompletionStatus(s_completionPort, 0, 0, 0);
-        while (count == s_taskThreads)
-            Sleep(1);
+    if (s_monitorThread) {
+        SetEvent(s_monitorQuitEvt);
+        WaitForSingleObject(s_monitorThread, INFINITE);
+        CloseHandle(s_monitorThread);
+        CloseHandle(s_monitorQuitEvt);
+        s_monitorThread  = NULL;
+        s_monitorQuitEvt = NULL;
     }
 
-    if (s_completionPort) {
-        CloseHandle(s_completionPort);
-        s_completionPort = NULL;
+    // The controller has stopped, so resume parked threads for good
+    s_parkRequests = 0;
+    for (unsigned i = 0; i < s_taskThreadCount; ++i)
+        SetEvent(s_taskThreads[i].wakeEvt);
+
+    // Each thread exits after consuming exactly one quit notification
+    for (unsigned i = 0; i < s_taskThreadCount; ++i)
+        PortPost(s_taskThreads[i].port, NULL, 0, NULL);
+
+    for (unsigned i = 0; i < s_taskThreadCount; ++i) {
+        WaitForSingleObject(s_taskThreads[i].handle, INFINITE);
+        TimerWheelDestroy(s_taskThreads[i].timers);
+        CloseHandle(s_taskThreads[i].handle);
+        CloseHandle(s_taskThreads[i].wakeEvt);
     }
+    MemFree(s_taskThreadMem);
+    s_taskThreadMem = NULL;
+    s_taskThreads = NULL;
+    s_taskThreadCount = 0;
+
+    // All operations must have completed and been freed by now
+    delete s_opPool;
+    s_opPool = NULL;
+
+    NodesDestroy();
+    TimeDestroy();
+}
+
+//=============================================================================
+unsigned TaskNodeCount () {
+    return s_nodeCount;
+}
+
+//=============================================================================
+void TaskRegisterHandle (
+    CTask *     task,
+    HANDLE      handle
+) {
+    TaskRegisterHandle(task, handle, PickNode());
 }
 
 //=============================================================================
 void TaskRegisterHandle (
-    CTask * task,
-    HANDLE  handle
+    CTask *     task,
+    HANDLE      handle,
+    unsigned    node
 ) {
     ASSERT(task);
-    if (task && !CreateIoCompletionPort(handle, s_completionPort, (DWORD) task, 0)) {
-        LOG_OS_LAST_ERROR(L"CreateIoCompletionPort");
-        FatalError();
+    ASSERT(node < s_nodeCount);
+    if (task)
+        PortAssociate(s_nodes[node % s_nodeCount].port, handle, task);
+}
+
+//=============================================================================
+void TaskRegisterOpHandle (HANDLE handle) {
+    PortAssociate(s_nodes[PickNode()].port, handle, &s_opTask);
+}
+
+//=============================================================================
+TaskOp * TaskOpAlloc (FTaskOpProc proc, void * context) {
+    ASSERT(proc);
+    TaskOp * op = (TaskOp *) s_opPool->Alloc();
+    ZERO(op->olap);
+    op->proc        = proc;
+    op->context     = context;
+    op->issueTime   = s_timing ? TimingNow() : 0;
+    return op;
+}
+
+//=============================================================================
+void TaskOpFree (TaskOp * op) {
+    s_opPool->Free(op);
+}
+
+//=============================================================================
+bool TaskCancel (HANDLE handle, OVERLAPPED * olap) {
+    if (CancelIoEx(handle, olap))
+        return true;
+
+    DWORD error = GetLastError();
+    if (error != ERROR_NOT_FOUND)
+        LOG_OS_ERROR(L"CancelIoEx", error);
+    return false;
+}
+
+//=============================================================================
+void TaskDeadlineSet (
+    TaskDeadline *  deadline,
+    HANDLE          handle,
+    OVERLAPPED *    olap,
+    unsigned        ms
+) {
+    DeadlineShard * shard = DeadlineGetShard(deadline);
+    shard->critsect.Enter();
+    deadline->handle    = handle;
+    deadline->olap      = olap;
+    deadline->expireMs  = TimeGetCoarseMs() + ms;
+    if (!deadline->link.IsLinked())
+        shard->list.InsertTail(deadline);
+    shard->critsect.Leave();
+}
+
+//=============================================================================
+void TaskDeadlineClear (TaskDeadline * deadline) {
+    DeadlineShard * shard = DeadlineGetShard(deadline);
+    shard->critsect.Enter();
+    deadline->link.Unlink();
+    shard->critsect.Leave();
+}
+
+//=============================================================================
+bool TaskPost (
+    TaskWork *      work,
+    FTaskWorkProc   proc,
+    void *          context,
+    FTaskWorkProc   shedProc
+) {
+    ASSERT(work);
+    ASSERT(proc);
+    work->proc      = proc;
+    work->shedProc  = shedProc;
+    work->context   = context;
+    work->postTime  = s_timing ? TimingNow() : 0;
+
+    // Work posted by a task callback stays on the posting thread
+    if (s_thread && s_workStealing && DequePush(&s_thread->deque, work))
+        return true;
+
+    TaskNode * node = &s_nodes[PickNode()];
+    if (!AdmitWork(node, work))
+        return false;
+
+    PortPost(node->port, &s_workTask, 0, (OVERLAPPED *) work);
+    return true;
+}
+
+//=============================================================================
+bool TaskPostBatchEnd (
+    TaskWork *      work,
+    FTaskWorkProc   proc,
+    void *          context
+) {
+    ASSERT(work);
+    ASSERT(proc);
+    TaskThread * thread = s_thread;
+    if (!thread)
+        return false;
+
+    work->proc      = proc;
+    work->shedProc  = NULL;
+    work->context   = context;
+    work->postTime  = s_timing ? TimingNow() : 0;
+    work->next      = thread->batchEnd;
+    thread->batchEnd = work;
+    return true;
+}
+
+//=============================================================================
+unsigned TaskQueuedWork () {
+    long queued = 0;
+    for (unsigned i = 0; i < s_nodeCount; ++i) {
+        long depth = QueueDepth(&s_nodes[i]);
+        if (depth > 0)
+            queued += depth;
+    }
+    return (unsigned) queued;
+}
+
+//=============================================================================
+bool TaskIsSaturated () {
+    if (!s_maxQueuedWork)
+        return false;
+
+    long highWater = (long) (s_maxQueuedWork - s_maxQueuedWork / 4);
+    for (unsigned i = 0; i < s_nodeCount; ++i) {
+        if (QueueDepth(&s_nodes[i]) >= highWater)
+            return true;
+    }
+    return false;
+}
+
+//=============================================================================
+void TaskParallelFor (
+    unsigned        begin,
+    unsigned        end,
+    unsigned        grain,
+    FTaskForProc    proc,
+    void *          context
+) {
+    ASSERT(proc);
+    if (begin >= end)
+        return;
+    if (!grain)
+        grain = 1;
+
+    // There's no point in more helpers than sub-ranges or other threads
+    unsigned ranges  = (end - begin - 1) / grain + 1;
+    unsigned helpers = ranges - 1;
+    unsigned active  = (unsigned) s_activeThreads;
+    unsigned others  = (s_thread && active) ? active - 1 : active;
+    if (helpers > others)
+        helpers = others;
+
+    if (!helpers) {
+        for (unsigned first = begin; first < end; ) {
+            unsigned last = (end - first > grain) ? first + grain : end;
+            proc(context, first, last);
+            first = last;
+        }
+        return;
+    }
+
+    ParallelFor * loop = (ParallelFor *) ALLOC(
+        offsetof(ParallelFor, helpers) + helpers * sizeof(loop->helpers[0])
+    );
+    loop->proc          = proc;
+    loop->context       = context;
+    loop->begin         = begin;
+    loop->end           = end;
+    loop->grain         = grain;
+    loop->ranges        = ranges;
+    loop->nextRange     = 0;
+    loop->doneRanges    = 0;
+    loop->refs          = (long) helpers + 1;
+    // The caller runs any ranges that rejected or shed helpers don't
+    for (unsigned i = 0; i < helpers; ++i) {
+        if (!TaskPost(&loop->helpers[i], ParallelForHelperProc, loop, ParallelForShedProc))
+            ParallelForRelease(loop);
+    }
+
+    ParallelForRun(loop);
+
+    // Every sub-range has been claimed; wait for the ones other threads
+    // are still running. They're already executing so this can't deadlock.
+    while ((unsigned) loop->doneRanges != ranges)
+        SwitchToThread();
+
+    ParallelForRelease(loop);
+}
+
+//=============================================================================
+void TaskGetStats (TaskStats * stats) {
+    // Counters are read without synchronization, so the totals are
+    // approximate while the task threads are running
+    stats->threads          = s_taskThreadCount;
+    stats->activeThreads    = (unsigned) s_activeThreads;
+    stats->blockedThreads   = s_blockedThreads;
+    stats->queuedWork       = TaskQueuedWork();
+    stats->rejected         = 0;
+    stats->shed             = 0;
+    for (unsigned i = 0; i < s_nodeCount; ++i) {
+        stats->rejected += (unsigned long) s_nodes[i].rejected;
+        stats->shed     += (unsigned long) s_nodes[i].shed;
+    }
+    stats->batches      = 0;
+    stats->completions  = 0;
+    stats->steals       = 0;
+    for (unsigned i = 0; i < s_taskThreadCount; ++i) {
+        stats->batches      += s_taskThreads[i].batches;
+        stats->completions  += s_taskThreads[i].completions;
+        stats->steals       += s_taskThreads[i].steals;
     }
 }
 
+//=============================================================================
+void TaskDumpStats (FTaskDumpProc proc, void * context) {
+    ASSERT(proc);
+
+    // Merge every thread's entries by key; the overflow entries all have
+    // a NULL key so they merge together
+    unsigned maxTypes = s_taskThreadCount * (TIMING_TYPES + 1);
+    TaskTiming * merged = (TaskTiming *) ALLOC(maxTypes * sizeof(TaskTiming));
+    unsigned types = 0;
+    for (unsigned t = 0; t < s_taskThreadCount; ++t) {
+        for (unsigned i = 0; i <= TIMING_TYPES; ++i) {
+            const TaskTiming & src = s_taskThreads[t].timing[i];
+            const void * key = src.key;
+            _ReadBarrier();
+            if (!src.count || (!key && i != TIMING_TYPES))
+                continue;
+
+            unsigned j = 0;
+            for (; j < types; ++j) {
+                if (merged[j].key == key)
+                    break;
+            }
+            TaskTiming & dst = merged[j];
+            if (j == types) {
+                ZERO(dst);
+                dst.key  = key;
+                dst.name = src.name;
+                ++types;
+            }
+
+            dst.count       += src.count;
+            dst.runNs    += src.runNs;
+            dst.waited      += src.waited;
+            dst.waitNs   += src.waitNs;
+            for (unsigned b = 0; b < TIMING_BUCKETS; ++b) {
+                dst.run[b]  += src.run[b];
+                dst.wait[b] += src.wait[b];
+            }
+        }
+    }
+
+    char line[256];
+    StrPrintf(
+        line,
+        _countof(line),
+        "%-40s %10s | %8s %7s %7s %7s | %8s %7s %7s %7s",
+        "Task (times in us)", "count",
+        "run avg", "p50", "p99", "p99.9",
+        "wait avg", "p50", "p99", "p99.9"
+    );
+    proc(context, line);
+
+    for (unsigned i = 0; i < types; ++i) {
+        const TaskTiming & timing = merged[i];
+
+        char name[64];
+        if (timing.name)
+            StrCopy(name, _countof(name), timing.name);
+        else if (timing.key)
+            StrPrintf(name, _countof(name), "callback %p", timing.key);
+        else
+            StrCopy(name, _countof(name), "(other)");
+
+        char run[64];
+        char wait[64];
+        TimingDumpHistogram(run, _countof(run), timing.run, timing.count, timing.runNs);
+        TimingDumpHistogram(wait, _countof(wait), timing.wait, timing.waited, timing.waitNs);
+
+        StrPrintf(
+            line,
+            _countof(line),
+            "%-40s %10I64u | %s | %s",
+            name,
+            timing.count,
+            run,
+            wait
+        );
+        proc(context, line);
+    }
+
+    MemFree(merged);
+}
 
 //===================================
 // MIT License
@@ -28,6 +28,150 @@ public:
     ) = 0;
 };
 
+// Callback for work items queued with TaskPost
+typedef void (* FTaskWorkProc)(void * context);
+
+// Embed a TaskWork in the object that owns the work, the same way a
+// LIST_LINK is embedded; TaskPost queues the node itself so posting
+// never allocates:
+//      struct CFoo {
+//          TaskWork    m_work;
+//          ...
+//      };
+//      TaskPost(&foo->m_work, FooWorkProc, foo);
+//
+// The fields belong to the task module. A node can't be posted again
+// until its callback (or shed callback) has been called.
+struct TaskWork {
+    FTaskWorkProc   proc;
+    FTaskWorkProc   shedProc;
+    void *          context;
+    u64             postTime;
+    long            seq;
+    TaskWork *      next;
+};
+
+// What TaskPost does with work beyond TaskConfig::maxQueuedWork
+enum ETaskOverflow {
+    // TaskPost returns false without queueing the work
+    TASK_OVERFLOW_REJECT,
+
+    // The work is queued and the oldest queued work is dropped instead;
+    // its shed callback is called in place of its callback
+    TASK_OVERFLOW_SHED_OLDEST,
+
+    // TaskPost waits until there's room. Task threads never wait, since
+    // they may be the ones that would make room.
+    TASK_OVERFLOW_BLOCK,
+};
+
+// Completion callback for a TaskOp
+typedef void (* FTaskOpProc)(struct TaskOp * op, unsigned bytes);
+
+// A single asynchronous operation that completes to its own callback,
+// so an operation doesn't need its own CTask subclass and state machine.
+// Ops come from a pool, so steady-state I/O doesn't allocate:
+//      TaskRegisterOpHandle(file);
+//      TaskOp * op = TaskOpAlloc(OnRead, this);
+//      op->olap.Offset = offset;
+//      if (!ReadFile(file, buf, bytes, NULL, &op->olap) && GetLastError() != ERROR_IO_PENDING)
+//          TaskOpFree(op);
+//      ...
+//      static void OnRead (TaskOp * op, unsigned bytes) {
+//          CFoo * foo = (CFoo *) op->context;
+//          bool failed = TaskOpFailed(op);
+//          TaskOpFree(op);
+//          ...
+//      }
+struct TaskOp {
+    OVERLAPPED      olap;           // pass &olap to the overlapped API
+    FTaskOpProc     proc;
+    void *          context;
+    u64             issueTime;      // set by TaskOpAlloc
+};
+
+// A deadline for an overlapped operation. Embed it in the object that
+// owns the operation, the same way as TaskWork, and arm it each time the
+// operation is issued. An operation still pending when the deadline
+// passes is cancelled and completes with ERROR_OPERATION_ABORTED.
+//      TaskDeadlineSet(&m_readDeadline, file, &m_olap, 30 * 1000);
+//      if (!ReadFile(file, buf, bytes, NULL, &m_olap) && GetLastError() != ERROR_IO_PENDING)
+//          TaskDeadlineClear(&m_readDeadline);
+//      ...
+//      void TaskComplete (unsigned bytes, OVERLAPPED * olap) {
+//          TaskDeadlineClear(&m_readDeadline);
+//          ...
+//      }
+struct TaskDeadline {
+    LIST_LINK(TaskDeadline) link;
+    HANDLE                  handle;
+    OVERLAPPED *            olap;
+    unsigned                expireMs;
+};
+
+// Receives TaskDumpStats output one line at a time
+typedef void (* FTaskDumpProc)(void * context, const char line[]);
+
+struct TaskConfig {
+    // Number of task threads to start with; zero means one per processor
+    unsigned    threads;
+
+    // When maxThreads is above minThreads the pool adapts: every adjustMs
+    // it adds a thread for each one blocked in a callback, and otherwise
+    // climbs toward the thread count with the best measured throughput.
+    // Zero for either bound means "threads", so by default the pool is fixed.
+    unsigned    minThreads;
+    unsigned    maxThreads;
+    unsigned    adjustMs;
+
+    // Maximum completions each thread dequeues per wakeup; completions
+    // in a batch are dispatched back-to-back. One disables batching.
+    unsigned    batchSize;
+
+    // Work posted from inside a task callback goes onto the posting
+    // thread's own deque, and idle threads steal from busy ones. When
+    // false all work goes through the shared completion port.
+    bool        workStealing;
+
+    // Limit on work waiting in each node's completion port; zero means no
+    // limit. Work queued on a task thread's own deque isn't counted, and
+    // I/O completions can't be limited since the kernel queues them.
+    unsigned        maxQueuedWork;
+    ETaskOverflow   overflow;
+
+    // Give each NUMA node its own completion port and keep each thread on
+    // one node's processors, so a handle's completions are processed on
+    // the node it was registered to (see TaskRegisterHandle)
+    bool        numaAware;
+
+    // Bind each thread to a single processor, spread across nodes
+    bool        pinThreads;
+
+    // Record how long completions wait to be dispatched and how long
+    // their callbacks run, per task type (see TaskDumpStats)
+    bool        timing;
+
+    // When non-zero TaskDumpStats is called every statsDumpMs with
+    // dumpProc, or writes to the debugger if dumpProc is NULL
+    unsigned        statsDumpMs;
+    FTaskDumpProc   dumpProc;
+    void *          dumpContext;
+
+    TaskConfig ();
+};
+
+struct TaskStats {
+    unsigned    threads;        // threads started
+    unsigned    activeThreads;  // threads not parked by the pool controller
+    unsigned    blockedThreads; // threads the controller last saw blocked
+    unsigned    queuedWork;     // posted work waiting in the completion ports
+    u64         rejected;       // posts refused by TASK_OVERFLOW_REJECT
+    u64         shed;           // work dropped by TASK_OVERFLOW_SHED_OLDEST
+    u64         batches;        // wakeups that dequeued completions
+    u64         completions;    // completions dispatched; divide by batches for average batch size
+    u64         steals;         // work items taken from another thread's deque
+};
+
 
 /******************************************************************************
 *
@@ -36,13 +180,229 @@ public:
 ***/
 
 void TaskInitialize ();
+void TaskInitialize (const TaskConfig & config);
 void TaskDestroy ();
 
+// Nodes are numbered from zero up to TaskNodeCount() - 1, counting only
+// the NUMA nodes with processors this process can run on. There is a
+// single node unless TaskConfig::numaAware is set.
+unsigned TaskNodeCount ();
+
+// Completions for the handle are dispatched by threads on the given node.
+// Without a node, a handle registered from a task thread stays on that
+// thread's node and others are spread across the nodes round-robin.
+void TaskRegisterHandle (
+    CTask *     task,
+    HANDLE      handle
+);
 void TaskRegisterHandle (
-    CTask * task,
-    HANDLE  handle
+    CTask *     task,
+    HANDLE      handle,
+    unsigned    node
+);
+
+// Route completions for a handle to the TaskOp that issued each operation
+void TaskRegisterOpHandle (HANDLE handle);
+
+// Allocate a TaskOp from the pool with a zeroed OVERLAPPED; free it
+// once its callback has been called (or the operation failed to start)
+TaskOp * TaskOpAlloc (FTaskOpProc proc, void * context);
+void TaskOpFree (TaskOp * op);
+
+// Cancel a pending operation, or with a NULL olap every operation issued
+// on the handle; cancelled operations complete with ERROR_OPERATION_ABORTED.
+// Returns false if there was nothing to cancel.
+bool TaskCancel (HANDLE handle, OVERLAPPED * olap);
+
+// Arm the deadline just before issuing the operation. Deadlines are
+// checked by the monitor thread, so they fire up to 100ms late.
+void TaskDeadlineSet (
+    TaskDeadline *  deadline,
+    HANDLE          handle,
+    OVERLAPPED *    olap,
+    unsigned        ms
+);
+
+// Disarm the deadline when the operation completes or fails to start,
+// before its OVERLAPPED is reused and before the deadline is destroyed
+void TaskDeadlineClear (TaskDeadline * deadline);
+
+// True if the completed operation reported an error
+inline bool TaskOpFailed (const TaskOp * op) {
+    // OVERLAPPED::Internal holds the operation's NTSTATUS; errors are negative
+    return (long) op->olap.Internal < 0;
+}
+
+// Run proc(context) on a task thread. Work posted from a task callback
+// is queued on the calling thread (see TaskConfig::workStealing).
+// Returns false if the work was rejected because the queue is full; if
+// the work is shed later, shedProc(context) is called instead of proc.
+bool TaskPost (
+    TaskWork *      work,
+    FTaskWorkProc   proc,
+    void *          context,
+    FTaskWorkProc   shedProc = NULL
+);
+
+// From a task callback, run proc(context) on the calling thread once it
+// has dispatched the rest of its current batch of completions and the
+// work they posted; useful for flushing output produced during the batch.
+// Returns false without queueing anything if not called on a task thread.
+bool TaskPostBatchEnd (
+    TaskWork *      work,
+    FTaskWorkProc   proc,
+    void *          context
+);
+
+// Posted work waiting to be dispatched, across all nodes
+unsigned TaskQueuedWork ();
+
+// True while any node's queue is at least three-quarters full, so that
+// network handlers can stop reading from clients before work is lost.
+// Always false without TaskConfig::maxQueuedWork.
+bool TaskIsSaturated ();
+
+void TaskGetStats (TaskStats * stats);
+
+// Write a table of queue-wait and run-time percentiles for each CTask
+// class, TaskPost callback and TaskOp callback that has run. Queue wait
+// is measured from TaskPost for posted work and from TaskOpAlloc for
+// ops, so for ops it covers the whole operation; the kernel doesn't
+// timestamp other completions, so they only report run time.
+void TaskDumpStats (FTaskDumpProc proc, void * context);
+
+
+/******************************************************************************
+*
+*   Parallel loops
+*
+*   Splits [begin, end) into consecutive sub-ranges at most "grain" long
+*   and runs them across the task threads. The calling thread runs
+*   sub-ranges too and returns once all of them are done, so loops can be
+*   started from inside task callbacks and nested without deadlocking.
+*
+*       TaskParallelFor(0, count, 64, [&](unsigned first, unsigned last) {
+*           for (unsigned i = first; i < last; ++i)
+*               entities[i].Update();
+*       });
+*
+*       unsigned total = TaskParallelReduce(0, count, 64, 0u,
+*           [&](unsigned first, unsigned last) -> unsigned {
+*               unsigned sum = 0;
+*               for (unsigned i = first; i < last; ++i)
+*                   sum += entities[i].Health();
+*               return sum;
+*           },
+*           [](unsigned a, unsigned b) { return a + b; }
+*       );
+*
+*   Partial results are combined in range order on the calling thread.
+*
+***/
+
+typedef void (* FTaskForProc)(void * context, unsigned first, unsigned last);
+
+void TaskParallelFor (
+    unsigned        begin,
+    unsigned        end,
+    unsigned        grain,
+    FTaskForProc    proc,
+    void *          context
 );
 
+template<class F>
+void TaskParallelFor (
+    unsigned        begin,
+    unsigned        end,
+    unsigned        grain,
+    const F &       fn
+);
+
+template<class T, class FMap, class FCombine>
+T TaskParallelReduce (
+    unsigned        begin,
+    unsigned        end,
+    unsigned        grain,
+    const T &       identity,
+    const FMap &    map,
+    const FCombine & combine
+);
+
+
+//=============================================================================
+template<class F>
+void TaskParallelForThunk (void * context, unsigned first, unsigned last) {
+    (* (const F *) context)(first, last);
+}
+
+//=============================================================================
+template<class F>
+void TaskParallelFor (
+    unsigned        begin,
+    unsigned        end,
+    unsigned        grain,
+    const F &       fn
+) {
+    TaskParallelFor(begin, end, grain, TaskParallelForThunk<F>, (void *) &fn);
+}
+
+//=============================================================================
+template<class T, class FMap>
+struct TTaskReduceRange {
+    unsigned        begin;
+    unsigned        grain;
+    T *             partials;
+    const FMap *    map;
+
+    void operator() (unsigned first, unsigned last) const {
+        partials[(first - begin) / grain] = (*map)(first, last);
+    }
+};
+
+//=============================================================================
+template<class T, class FMap, class FCombine>
+T TaskParallelReduce (
+    unsigned        begin,
+    unsigned        end,
+    unsigned        grain,
+    const T &       identity,
+    const FMap &    map,
+    const FCombine & combine
+) {
+    if (begin >= end)
+        return identity;
+    if (!grain)
+        grain = 1;
+
+    // One result slot per sub-range; these must match TaskParallelFor's
+    // split. Rather than allocate a slot for every sub-range, long loops
+    // are run in spans of TASK_REDUCE_SPAN_RANGES sub-ranges, which is
+    // plenty to keep the task threads busy.
+    const unsigned TASK_REDUCE_SPAN_RANGES = 64;
+    T partials[TASK_REDUCE_SPAN_RANGES];
+    TTaskReduceRange<T, FMap> reduce;
+    reduce.grain    = grain;
+    reduce.partials = partials;
+    reduce.map      = &map;
+
+    T result = identity;
+    while (begin < end) {
+        unsigned ranges  = (end - begin - 1) / grain + 1;
+        unsigned spanEnd = end;
+        if (ranges > TASK_REDUCE_SPAN_RANGES) {
+            ranges  = TASK_REDUCE_SPAN_RANGES;
+            spanEnd = begin + ranges * grain;
+        }
+
+        reduce.begin = begin;
+        TaskParallelFor(begin, spanEnd, grain, reduce);
+        for (unsigned i = 0; i < ranges; ++i)
+            result = combine(result, partials[i]);
+        begin = spanEnd;
+    }
+    return result;
+}
+
 
 //===================================
 // MIT License
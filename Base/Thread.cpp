@@ -27,7 +27,7 @@ struct Thread {
     Thread (const char name[])
         :m_id(0)
         ,m_handle(NULL)
-        ,m_lastTimeMs(GetTickCount())
+        ,m_lastTimeMs(TimeGetCoarseMs())
         ,m_name(StrDupAnsi(name))
     {}
 
@@ -84,11 +84,13 @@ static void LogThreads_CS () {
 
 //=============================================================================
 static void CheckForDeadlocks_CS () {
-    unsigned timeMs = GetTickCount();
+    unsigned timeMs = TimeGetCoarseMs();
     for (const Thread * t = s_threads.Head(); t; t = t->m_link.Next()) {
         // delta might be less than zero because of an inherent
         // race condition with ThreadMarkAlive; that's okay, but
-        // requires that we use a signed comparison below.
+        // requires that we use a signed comparison below. Subtracting
+        // before the cast also keeps the comparison correct when the
+        // millisecond clock wraps.
         signed delta = (signed) (timeMs - t->m_lastTimeMs);
         if (delta < (signed) DEADLOCK_CHECK_FREQUENCY_MS)
             continue;
@@ -240,7 +242,7 @@ void ThreadUnregister (Thread * t) {
 
 //=============================================================================
 void ThreadMarkAlive (Thread * thread) {
-    thread->m_lastTimeMs = GetTickCount();
+    thread->m_lastTimeMs = TimeGetCoarseMs();
 }
 
 //=============================================================================
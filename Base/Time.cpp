@@ -12,13 +12,358 @@
 #pragma hdrstop
 
 
+/******************************************************************************
+*
+*   Private
+*
+*   Readings of the time-stamp counter, or of QueryPerformanceCounter on
+*   processors whose counter changes rate with power states, are converted
+*   to nanoseconds by multiplying by a 32.32 fixed-point scale, so reading
+*   the clock needs no division. The first reading calibrates the counter
+*   against QueryPerformanceCounter, and the ticker thread then compares
+*   the two every second and slews the scale so that the error from the
+*   calibration can't accumulate.
+*
+*   The conversion parameters can't be updated atomically, so each update
+*   is written to an unused slot of a small ring and then published by
+*   swapping a pointer. Each slot also has a version, odd while the slot
+*   is being written, so that a reader stalled for long enough that its
+*   slot comes around again retries instead of using a half-written slot.
+*
+***/
+
+static const unsigned CALIBRATE_MS = 20;
+
+// Each sample pairs a QueryPerformanceCounter reading with the time-stamp
+// readings either side of it; the narrowest of several is used, so a
+// preemption between the reads can't skew it
+static const unsigned SAMPLE_TRIES = 8;
+
+// Calibrations must agree this closely, in parts per million, or the
+// time-stamp counter isn't trusted
+static const unsigned CALIBRATE_MAX_PPM = 1000;
+
+// The slew corrects the accumulated error at no more than 0.1% of the
+// interval, so the clock stays smooth and monotonic
+static const unsigned SLEW_INTERVAL_MS = 1000;
+static const unsigned SLEW_MAX_DIVISOR = 1000;
+
+static const unsigned CLOCK_PARAM_SLOTS = 4;
+
+// A one millisecond wait lasts until the next system timer tick
+static const unsigned TICKER_SLEEP_MS = 1;
+
+static const u64 FILETIME_PER_SEC = 10000000;
+static const unsigned SECS_PER_DAY = 24 * 60 * 60;
+
+enum EClockState {
+    CLOCK_UNCALIBRATED,
+    CLOCK_CALIBRATING,
+    CLOCK_READY,
+};
+
+// Kept on its own cache line, which only the ticker writes
+struct __declspec(align(64)) CoarseClock {
+    volatile bool       running;
+    volatile unsigned   ms;
+    volatile unsigned   utcSecs;
+};
+
+static CoarseClock      s_coarse;
+static HANDLE           s_tickerThread;
+static HANDLE           s_tickerQuitEvt;
+
+struct ClockParams {
+    volatile long   version;        // odd while being written
+    u64             baseCount;      // counter reading at baseNs
+    u64             baseNs;
+    u64             scale;          // nanoseconds per count, 32.32 fixed point
+};
+
+static volatile long                s_state;
+static bool                         s_useTsc;
+static u64                          s_qpcScale;
+static ClockParams                  s_params[CLOCK_PARAM_SLOTS];
+static const ClockParams * volatile s_current;
+static unsigned                     s_nextSlot;
+
+// The last sample, for slewing
+static u64                          s_slewTsc;
+static u64                          s_slewQpc;
+
+
+//=============================================================================
+static inline u64 QpcNow () {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (u64) now.QuadPart;
+}
+
+//=============================================================================
+// Returns (a * b) >> 32 without overflowing, provided the result fits
+static inline u64 MulShift32 (u64 a, u64 b) {
+    u64 aLo = (u32) a;
+    u64 aHi = a >> 32;
+    u64 bLo = (u32) b;
+    u64 bHi = b >> 32;
+    return ((aHi * bHi) << 32) + aHi * bLo + aLo * bHi + ((aLo * bLo) >> 32);
+}
+
+//=============================================================================
+static bool HasInvariantTsc () {
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if ((unsigned) regs[0] < 0x80000007)
+        return false;
+    __cpuid(regs, 0x80000007);
+    return (regs[3] & (1 << 8)) != 0;
+}
+
+//=============================================================================
+static void Publish (u64 baseCount, u64 baseNs, u64 scale) {
+    ClockParams * params = &s_params[s_nextSlot];
+    s_nextSlot = (s_nextSlot + 1) % CLOCK_PARAM_SLOTS;
+    params->version  += 1;
+    _WriteBarrier();
+    params->baseCount = baseCount;
+    params->baseNs    = baseNs;
+    params->scale     = scale;
+    _WriteBarrier();
+    params->version  += 1;
+    InterlockedExchangePointer((void * volatile *) &s_current, params);
+}
+
+//=============================================================================
+// Copies the published parameters, retrying if their slot is rewritten
+// while they're read
+static inline void ReadParams (ClockParams * params) {
+    for (;;) {
+        const ClockParams * current = s_current;
+        long version = current->version;
+        _ReadBarrier();
+        params->baseCount = current->baseCount;
+        params->baseNs    = current->baseNs;
+        params->scale     = current->scale;
+        _ReadBarrier();
+        if (!(version & 1) && version == current->version)
+            return;
+    }
+}
+
+//=============================================================================
+static inline u64 Convert (const ClockParams * params, u64 count) {
+    // Another processor's counter may lag slightly behind the base
+    i64 delta = (i64) (count - params->baseCount);
+    if (delta < 0)
+        delta = 0;
+    return params->baseNs + MulShift32((u64) delta, params->scale);
+}
+
+//=============================================================================
+static void Sample (u64 * tsc, u64 * qpc) {
+    u64 best = (u64) -1;
+    for (unsigned i = 0; i < SAMPLE_TRIES; ++i) {
+        u64 before = __rdtsc();
+        u64 now    = QpcNow();
+        u64 after  = __rdtsc();
+        if (after - before < best) {
+            best = after - before;
+            *tsc = before + (after - before) / 2;
+            *qpc = now;
+        }
+    }
+}
+
+//=============================================================================
+// Returns nanoseconds per time-stamp tick in 32.32 fixed point, or zero
+static u64 MeasureTscScale (u64 * tsc, u64 * qpc) {
+    u64 tsc0, qpc0;
+    Sample(&tsc0, &qpc0);
+    Sleep(CALIBRATE_MS);
+    Sample(tsc, qpc);
+
+    u64 ns    = MulShift32(*qpc - qpc0, s_qpcScale);
+    u64 ticks = *tsc - tsc0;
+    return ticks ? (ns << 32) / ticks : 0;
+}
+
+//=============================================================================
+static void Calibrate () {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    s_qpcScale = ((u64) 1000000000 << 32) / (u64) freq.QuadPart;
+
+    // Calibrate twice; if the results disagree the counter isn't steady
+    // enough to use
+    u64 tsc, qpc;
+    u64 scale = 0;
+    if (HasInvariantTsc()) {
+        u64 first = MeasureTscScale(&tsc, &qpc);
+        scale = MeasureTscScale(&tsc, &qpc);
+        u64 diff = first > scale ? first - scale : scale - first;
+        if (!scale || diff > scale / 1000000 * CALIBRATE_MAX_PPM)
+            scale = 0;
+    }
+
+    s_useTsc = scale != 0;
+    if (s_useTsc) {
+        s_slewTsc = tsc;
+        s_slewQpc = qpc;
+        Publish(tsc, MulShift32(qpc, s_qpcScale), scale);
+    }
+    else {
+        Publish(0, 0, s_qpcScale);
+    }
+}
+
+//=============================================================================
+// Called by the ticker thread. Sets the scale for the next interval to the
+// rate just measured plus a correction for the error that has built up.
+static void Slew () {
+    if (!s_useTsc)
+        return;
+
+    u64 tsc, qpc;
+    Sample(&tsc, &qpc);
+    u64 ticks      = tsc - s_slewTsc;
+    u64 intervalNs = MulShift32(qpc - s_slewQpc, s_qpcScale);
+    s_slewTsc = tsc;
+    s_slewQpc = qpc;
+
+    // After a long stall, e.g. a suspend, start a new interval; the error
+    // is corrected by the next slew
+    if ((i64) ticks <= 0 || intervalNs >= (u64) SLEW_INTERVAL_MS * 1000000 * 4)
+        return;
+
+    u64 clockNs    = Convert(s_current, tsc);
+    i64 errorNs    = (i64) (MulShift32(qpc, s_qpcScale) - clockNs);
+    i64 maxNs      = (i64) (intervalNs / SLEW_MAX_DIVISOR);
+    if (errorNs > maxNs)
+        errorNs = maxNs;
+    else if (errorNs < -maxNs)
+        errorNs = -maxNs;
+
+    u64 targetNs = (u64) ((i64) intervalNs + errorNs);
+    Publish(tsc, clockNs, (targetNs << 32) / ticks);
+}
+
+//=============================================================================
+static void ClockInitialize () {
+    if (CLOCK_UNCALIBRATED == InterlockedCompareExchange(&s_state, CLOCK_CALIBRATING, CLOCK_UNCALIBRATED)) {
+        Calibrate();
+        _WriteBarrier();
+        s_state = CLOCK_READY;
+        return;
+    }
+
+    // Another thread is calibrating
+    while (s_state != CLOCK_READY)
+        Sleep(1);
+}
+
+//=============================================================================
+static unsigned UtcSecsNow () {
+    FILETIME utc;
+    GetSystemTimeAsFileTime(&utc);
+    u64 secs = (((u64) utc.dwHighDateTime << 32) | utc.dwLowDateTime) / FILETIME_PER_SEC;
+    return (unsigned) (secs % SECS_PER_DAY);
+}
+
+//=============================================================================
+static void TickerUpdate () {
+    s_coarse.ms      = TimeGetMs();
+    s_coarse.utcSecs = UtcSecsNow();
+}
+
+//=============================================================================
+static unsigned __stdcall TickerThreadProc (void *) {
+    DebugSetThreadName("TimeTicker");
+    unsigned lastSlewMs = TimeGetMs();
+    while (WAIT_TIMEOUT == WaitForSingleObject(s_tickerQuitEvt, TICKER_SLEEP_MS)) {
+        TickerUpdate();
+        if (s_coarse.ms - lastSlewMs >= SLEW_INTERVAL_MS) {
+            lastSlewMs = s_coarse.ms;
+            Slew();
+        }
+    }
+    return 0;
+}
+
+
 /******************************************************************************
 *
 *   Exports
 *
 ***/
 
+//=============================================================================
+void TimeInitialize () {
+    ASSERT(!s_tickerThread);
+    TickerUpdate();
+    s_tickerQuitEvt = CreateEvent(NULL, true, false, NULL);
+
+    unsigned threadId;
+    if (NULL == (s_tickerThread = (HANDLE) _beginthreadex(
+        (LPSECURITY_ATTRIBUTES) NULL,
+        0,      // default stack size
+        TickerThreadProc,
+        NULL,
+        0,      // flags
+        &threadId
+    ))) {
+        LOG_OS_LAST_ERROR(L"_beginthreadex");
+        FatalError();
+    }
+
+    _WriteBarrier();
+    s_coarse.running = true;
+}
+
+//=============================================================================
+void TimeDestroy () {
+    if (!s_tickerThread)
+        return;
+
+    s_coarse.running = false;
+    SetEvent(s_tickerQuitEvt);
+    WaitForSingleObject(s_tickerThread, INFINITE);
+    CloseHandle(s_tickerThread);
+    s_tickerThread = NULL;
+    CloseHandle(s_tickerQuitEvt);
+    s_tickerQuitEvt = NULL;
+}
+
+//=============================================================================
+u64 TimeGetNs () {
+    if (s_state != CLOCK_READY)
+        ClockInitialize();
+    _ReadBarrier();
+
+    ClockParams params;
+    ReadParams(&params);
+    return Convert(&params, s_useTsc ? __rdtsc() : QpcNow());
+}
+
+//=============================================================================
+u64 TimeGetUs () {
+    return TimeGetNs() / 1000;
+}
+
 //=============================================================================
 unsigned TimeGetMs () {
-    return GetTickCount();
+    return (unsigned) (TimeGetNs() / 1000000);
+}
+
+//=============================================================================
+unsigned TimeGetCoarseMs () {
+    if (!s_coarse.running)
+        return TimeGetMs();
+    return s_coarse.ms;
+}
+
+//=============================================================================
+unsigned TimeGetCoarseUtcSecs () {
+    if (!s_coarse.running)
+        return UtcSecsNow();
+    return s_coarse.utcSecs;
 }
@@ -14,4 +14,23 @@
 #define TIME_H
 
 
+// Milliseconds; wraps every 49.7 days, so compare times by subtracting
+// them and casting the difference to int
 unsigned TimeGetMs ();
+
+// Monotonic, high-resolution time that doesn't wrap, for measuring
+// intervals. Based on the processor's time-stamp counter where it runs at
+// a constant rate, otherwise on QueryPerformanceCounter.
+u64 TimeGetUs ();
+u64 TimeGetNs ();
+
+// Coarse clocks for heartbeats, deadlines and log timestamps. A ticker
+// thread refreshes them about every system timer tick (1-16ms), so reading
+// them is a load from a cache line that changes only when it ticks. The
+// millisecond clock counts from the same origin as TimeGetMs. Outside
+// TimeInitialize and TimeDestroy, which TaskInitialize and TaskDestroy
+// call, they read the precise clocks instead.
+void TimeInitialize ();
+void TimeDestroy ();
+unsigned TimeGetCoarseMs ();
+unsigned TimeGetCoarseUtcSecs ();   // seconds since midnight UTC
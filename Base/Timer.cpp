@@ -11,38 +11,352 @@
 #include "stdafx.h"
 #pragma hdrstop
 
-#if 0
 
 
 /******************************************************************************
 *
 *   Private
 *
+*   Each task thread owns a hierarchical timing wheel with a one millisecond
+*   tick, which it advances between batches of completions. Level zero has
+*   a slot for each of the next 256 ticks; each higher level has 64 slots,
+*   each covering a full rotation of the level below. Setting a timer links
+*   it into the slot for its expiry, and when a lower level completes a
+*   rotation the next slot of the level above is emptied into the levels
+*   below it ("cascading"), so no operation depends on the number of timers.
+*
+*   Only the owning thread touches a wheel or the links of its timers, so
+*   a timer set or deleted on its own thread needs no lock. Other threads
+*   leave the request in the timer and push the timer onto its wheel's
+*   mailbox, a lock-free stack the owner empties before advancing, then
+*   wake the owner with an APC in case it's waiting for completions.
+*
+*   Deletes go on a second stack rather than into the timer's request: a
+*   thread may still be pushing a timer onto the mailbox after the owner
+*   has read its request, so the owner frees a timer only once the thread
+*   that deleted it has finished pushing it.
+*
 ***/
 
-static const unsigned MAX_SLEEP_MS = 5 * 1000;
-
-static const unsigned TIMER_FLAG_QUEUED = 1;
+static const unsigned LEVEL0_BITS   = 8;
+static const unsigned LEVEL0_SLOTS  = 1 << LEVEL0_BITS;
+static const unsigned LEVEL0_MASK   = LEVEL0_SLOTS - 1;
+static const unsigned LEVEL_BITS    = 6;
+static const unsigned LEVEL_SLOTS   = 1 << LEVEL_BITS;
+static const unsigned LEVEL_MASK    = LEVEL_SLOTS - 1;
+static const unsigned LEVELS        = 5;    // 8 + 4 * 6 bits covers every 32-bit expiry
+
+// Expiries must compare correctly across a wrap of the millisecond clock
+static const unsigned MAX_SLEEP_MS  = 0x7fffffff;
+
+// Most callbacks a thread runs before returning to its completions
+static const unsigned FIRE_BATCH    = 256;
+
+// Requests left in Timer::m_mail by other threads
+enum ETimerMail {
+    TIMER_MAIL_NONE,
+    TIMER_MAIL_SET,
+    TIMER_MAIL_STOP,
+};
 
+struct TimerWheel;
 
 struct Timer : public ITimer {
+    LIST_LINK(Timer)    m_link;
+    TimerWheel *        m_wheel;            // owner
     ITimerCallback *    m_callback;
-    unsigned            m_nextTimeMs;
-    unsigned            m_flags;
+    unsigned            m_expireMs;
+    unsigned            m_level;            // wheel level while linked, LEVELS once expired
+    volatile unsigned   m_slackMs;          // how late the callback may run
+    bool                m_firing;           // callback running
+    bool                m_deleted;
+    bool                m_setWhileFiring;   // m_expireMs holds the new expiry
+    bool                m_armWhileFiring;   // false if Set to TIMER_INFINITE_MS
+
+    // Written by other threads
+    volatile LONG64     m_mail;             // ETimerMail << 32 | expireMs
+    volatile long       m_mailQueued;       // in the mailbox
+    volatile long       m_deletePosted;     // stop calling back before the owner frees it
+    Timer *             m_mailNext;
+    Timer *             m_deleteNext;
 
     virtual void Delete ();
     virtual void Set (__in unsigned sleepMs);
+    virtual void Set (__in unsigned sleepMs, __in unsigned slackMs);
+};
 
-    bool operator < (const Timer & t) const;
+typedef LIST_DECLARE(Timer, m_link) TimerList;
+
+struct TimerWheel {
+    LIST_LINK(TimerWheel)   link;           // in s_wheels
+    HANDLE                  thread;
+    Timer * volatile        mailbox;
+    Timer * volatile        deletes;        // timers to free after the mailbox is emptied
+    volatile long           wakePending;    // an APC is queued to the owner
+    unsigned                wheelMs;        // next tick to process
+    unsigned                counts[LEVELS]; // timers linked at each level
+    TimerList               expired;        // waiting for their callbacks
+    TimerList               level0[LEVEL0_SLOTS];
+    TimerList               levels[LEVELS - 1][LEVEL_SLOTS];
 };
 
 
-static HANDLE       s_completionPort;
-static HANDLE       s_timerThread;
-static CCritSect    s_critsect;
+static CCritSect                            s_critsect;
+static LIST_DECLARE(TimerWheel, link)       s_wheels;
+static TimerWheel *                         s_nextWheel;    // for timers created off the task threads
+
+static __declspec(thread) TimerWheel *      t_wheel;
+
+
+//=============================================================================
+static void WheelInsert (TimerWheel * wheel, Timer * timer) {
+    // Expiries that have already passed go in the next slot to be processed
+    unsigned expireMs = timer->m_expireMs;
+    unsigned delta = expireMs - wheel->wheelMs;
+    if ((int) delta < 0) {
+        expireMs = wheel->wheelMs;
+        delta = 0;
+    }
 
-static SOME_PRIORITY_QUEUE_THING<Timer>    s_timerQ;
+    TimerList * list;
+    unsigned level;
+    if (delta < LEVEL0_SLOTS) {
+        level = 0;
+        list = &wheel->level0[expireMs & LEVEL0_MASK];
+    }
+    else {
+        level = 1;
+        unsigned shift = LEVEL0_BITS;
+        while (level < LEVELS - 1 && delta >= (1u << (shift + LEVEL_BITS))) {
+            shift += LEVEL_BITS;
+            ++level;
+        }
+        list = &wheel->levels[level - 1][(expireMs >> shift) & LEVEL_MASK];
+    }
 
+    timer->m_level = level;
+    wheel->counts[level] += 1;
+    list->InsertTail(timer);
+}
+
+//=============================================================================
+static void WheelRemove (TimerWheel * wheel, Timer * timer) {
+    if (!timer->m_link.IsLinked())
+        return;
+    timer->m_link.Unlink();
+    if (timer->m_level < LEVELS)
+        wheel->counts[timer->m_level] -= 1;
+}
+
+//=============================================================================
+// Re-inserts the timers of one slot, which all move to lower levels
+static void WheelCascade (TimerWheel * wheel, unsigned level, unsigned slot) {
+    TimerList * list = &wheel->levels[level - 1][slot];
+    while (Timer * timer = list->Head()) {
+        timer->m_link.Unlink();
+        wheel->counts[level] -= 1;
+        WheelInsert(wheel, timer);
+    }
+}
+
+//=============================================================================
+// Moves the timers that have expired by nowMs onto the expired list
+static void WheelAdvance (TimerWheel * wheel, unsigned nowMs, TimerList * expired) {
+    unsigned total = 0;
+    for (unsigned level = 0; level < LEVELS; ++level)
+        total += wheel->counts[level];
+
+    // An empty wheel can skip ahead, since there is nothing to cascade
+    if (!total) {
+        wheel->wheelMs = nowMs + 1;
+        return;
+    }
+
+    while ((int) (nowMs - wheel->wheelMs) >= 0) {
+        unsigned index = wheel->wheelMs & LEVEL0_MASK;
+        if (!index) {
+            for (unsigned level = 1; level < LEVELS; ++level) {
+                unsigned shift = LEVEL0_BITS + (level - 1) * LEVEL_BITS;
+                unsigned slot = (wheel->wheelMs >> shift) & LEVEL_MASK;
+                WheelCascade(wheel, level, slot);
+                if (slot)
+                    break;
+            }
+        }
+
+        TimerList * list = &wheel->level0[index];
+        while (Timer * timer = list->Head()) {
+            wheel->counts[0] -= 1;
+            timer->m_level = LEVELS;
+            expired->InsertTail(timer);
+        }
+
+        ++wheel->wheelMs;
+    }
+}
+
+//=============================================================================
+// Returns the time from nowMs until the wheel next needs advancing
+static unsigned WheelNextSleep (const TimerWheel * wheel, unsigned nowMs) {
+    unsigned upper = 0;
+    for (unsigned level = 1; level < LEVELS; ++level)
+        upper += wheel->counts[level];
+    if (!upper && !wheel->counts[0])
+        return TIMER_INFINITE_MS;
+
+    // With timers in the upper levels, wake for the next cascade
+    unsigned ticks = LEVEL0_SLOTS;
+    if (upper)
+        ticks -= wheel->wheelMs & LEVEL0_MASK;
+
+    if (wheel->counts[0]) {
+        for (unsigned i = 0; i < ticks; ++i) {
+            if (wheel->level0[(wheel->wheelMs + i) & LEVEL0_MASK].Head()) {
+                ticks = i;
+                break;
+            }
+        }
+    }
+
+    unsigned dueMs = wheel->wheelMs + ticks;
+    return (int) (dueMs - nowMs) > 0 ? dueMs - nowMs : 0;
+}
+
+//=============================================================================
+static inline unsigned ClampSleep (unsigned sleepMs) {
+    return sleepMs > MAX_SLEEP_MS ? MAX_SLEEP_MS : sleepMs;
+}
+
+//=============================================================================
+// Rounds the expiry up to a multiple of the largest power of two within
+// the slack, so timers whose windows overlap land on the same tick and are
+// run together in one pass over the wheel
+static unsigned ExpireMs (unsigned sleepMs, unsigned slackMs) {
+    unsigned expireMs = TimeGetMs() + ClampSleep(sleepMs);
+    unsigned granularity = 1;
+    while (granularity <= slackMs / 2)
+        granularity <<= 1;
+    return (expireMs + granularity - 1) & ~(granularity - 1);
+}
+
+//=============================================================================
+static void Arm (Timer * timer, unsigned expireMs) {
+    timer->m_expireMs = expireMs;
+    WheelInsert(timer->m_wheel, timer);
+}
+
+//=============================================================================
+static void CALLBACK WakeApc (ULONG_PTR) {
+    // Only interrupts the wait; the owner empties its mailbox next
+}
+
+//=============================================================================
+static void WakeOwner (TimerWheel * wheel) {
+    if (!InterlockedExchange(&wheel->wakePending, 1))
+        QueueUserAPC(WakeApc, wheel->thread, 0);
+}
+
+//=============================================================================
+static void MailPost (Timer * timer, ETimerMail mail, unsigned expireMs) {
+    // The latest request replaces any the owner hasn't seen yet
+    InterlockedExchange64(&timer->m_mail, ((LONG64) mail << 32) | expireMs);
+    if (InterlockedExchange(&timer->m_mailQueued, 1))
+        return;
+
+    TimerWheel * wheel = timer->m_wheel;
+    for (;;) {
+        Timer * head = wheel->mailbox;
+        timer->m_mailNext = head;
+        if (InterlockedCompareExchangePointer((void * volatile *) &wheel->mailbox, timer, head) == head)
+            break;
+    }
+
+    WakeOwner(wheel);
+}
+
+//=============================================================================
+// Queues the timer to be freed by its owner. Pushing it is the last thing
+// the deleting thread does with the timer.
+static void DeletePost (Timer * timer) {
+    InterlockedExchange(&timer->m_deletePosted, 1);
+
+    TimerWheel * wheel = timer->m_wheel;
+    for (;;) {
+        Timer * head = wheel->deletes;
+        timer->m_deleteNext = head;
+        if (InterlockedCompareExchangePointer((void * volatile *) &wheel->deletes, timer, head) == head)
+            break;
+    }
+
+    WakeOwner(wheel);
+}
+
+//=============================================================================
+static void MailDeliver (TimerWheel * wheel) {
+    InterlockedExchange(&wheel->wakePending, 0);
+
+    // Take the deletes first. Requests made before a Delete were pushed
+    // before it, so they're in the mailbox taken next or already applied.
+    Timer * deletes = (Timer *) InterlockedExchangePointer((void * volatile *) &wheel->deletes, NULL);
+
+    Timer * next = (Timer *) InterlockedExchangePointer((void * volatile *) &wheel->mailbox, NULL);
+    while (Timer * timer = next) {
+        next = timer->m_mailNext;
+
+        // Clear the flag first so a later request queues the timer again
+        InterlockedExchange(&timer->m_mailQueued, 0);
+        LONG64 mail = InterlockedExchange64(&timer->m_mail, 0);
+        if (timer->m_deletePosted)
+            continue;
+
+        unsigned expireMs = (unsigned) mail;
+        switch ((ETimerMail) (mail >> 32)) {
+            case TIMER_MAIL_SET:
+                WheelRemove(wheel, timer);
+                Arm(timer, expireMs);
+            break;
+
+            case TIMER_MAIL_STOP:
+                WheelRemove(wheel, timer);
+            break;
+        }
+    }
+
+    // No other thread can still be touching these timers
+    while (Timer * timer = deletes) {
+        deletes = timer->m_deleteNext;
+        WheelRemove(wheel, timer);
+        delete timer;
+    }
+}
+
+//=============================================================================
+static void Fire (Timer * timer) {
+    // Deleted by another thread; freed with the next mailbox delivery
+    if (timer->m_deletePosted)
+        return;
+
+    timer->m_firing = true;
+    unsigned sleepMs = timer->m_callback->OnTimer();
+    timer->m_firing = false;
+
+    // Apply Set and Delete calls made by the callback
+    if (timer->m_deleted) {
+        // A timer in the mailbox is freed after the mailbox is emptied
+        if (timer->m_mailQueued)
+            DeletePost(timer);
+        else
+            delete timer;
+    }
+    else if (timer->m_setWhileFiring) {
+        timer->m_setWhileFiring = false;
+        if (timer->m_armWhileFiring)
+            Arm(timer, timer->m_expireMs);
+    }
+    else if (sleepMs != TIMER_INFINITE_MS) {
+        Arm(timer, ExpireMs(sleepMs, timer->m_slackMs));
+    }
+}
 
 
 /******************************************************************************
@@ -53,72 +367,118 @@ static SOME_PRIORITY_QUEUE_THING<Timer>    s_timerQ;
 
 //=============================================================================
 void Timer::Delete () {
-    s_critsect.Enter();
-    if (m_flags & TIMER_FLAG_QUEUED) {
-        m_flags &= ~TIMER_FLAG_QUEUED;
-        s_timerQ._Get_container().erase(*this);
+    if (t_wheel != m_wheel) {
+        DeletePost(this);
+        return;
     }
-    s_critsect.Leave();
+
+    WheelRemove(m_wheel, this);
+    m_deleted = true;
+    if (m_firing)
+        return;
+    if (m_mailQueued)
+        DeletePost(this);
+    else
+        delete this;
 }
 
 //=============================================================================
 void Timer::Set (__in unsigned sleepMs) {
-    unsigned nextTimeMs = TimeGetMs() + sleepMs;
-
-    s_critsect.Enter();
-    {
-        if (m_flags & TIMER_FLAG_QUEUED) {
-            m_flags &= ~TIMER_FLAG_QUEUED;
-            s_timerQ.remove(*this);
-        }
-        if (sleepMs != TIMER_INFINITE_MS) {
-            m_flags |= TIMER_FLAG_QUEUED;
-            s_timerQ.add(*this);
-        }
-    }
-    s_critsect.Leave();
+    Set(sleepMs, m_slackMs);
 }
 
 //=============================================================================
-bool Timer::operator< (const Timer & t) const {
-    return (m_nextTimeMs - t.m_nextTimeMs) < 0;
+void Timer::Set (__in unsigned sleepMs, __in unsigned slackMs) {
+    m_slackMs = slackMs;
+    unsigned expireMs = ExpireMs(sleepMs, slackMs);
+    if (t_wheel != m_wheel) {
+        MailPost(this, sleepMs == TIMER_INFINITE_MS ? TIMER_MAIL_STOP : TIMER_MAIL_SET, expireMs);
+        return;
+    }
+
+    // This call supersedes requests from other threads
+    InterlockedExchange64(&m_mail, 0);
+    if (m_deleted) {
+        // Set after Delete is a bug, but the timer may not be gone yet
+    }
+    else if (m_firing) {
+        m_setWhileFiring = true;
+        m_armWhileFiring = sleepMs != TIMER_INFINITE_MS;
+        m_expireMs       = expireMs;
+    }
+    else {
+        WheelRemove(m_wheel, this);
+        if (sleepMs != TIMER_INFINITE_MS)
+            Arm(this, expireMs);
+    }
 }
 
 
 /******************************************************************************
 *
-*   Timer thread
+*   Task thread integration
 *
 ***/
 
 //=============================================================================
-static unsigned __stdcall TimerThreadProc (void *) {
-    DebugSetThreadName("Timer");
+TimerWheel * TimerWheelCreate (HANDLE thread) {
+    TimerWheel * wheel  = new TimerWheel;
+    wheel->thread       = thread;
+    wheel->mailbox      = NULL;
+    wheel->deletes      = NULL;
+    wheel->wakePending  = 0;
+    wheel->wheelMs      = TimeGetMs();
+    ZERO(wheel->counts);
 
-    unsigned sleepMs = MAX_SLEEP_MS;
-    for (;;) {
-        // Get the next task completion
-        DWORD bytes;
-        DWORD key;
-        OVERLAPPED * olap;
-        if (!GetQueuedCompletionStatus(
-            s_completionPort,
-            &bytes,
-            &key,
-            &olap,
-            sleepMs
-        )) {
-            LOG_OS_LAST_ERROR(L"GetQueuedCompletionStatus");
-            FatalError();
-        }
+    s_critsect.Enter();
+    s_wheels.InsertTail(wheel);
+    s_critsect.Leave();
+    return wheel;
+}
 
-        // If the task is NULL this is a thread-quit notification
-        if (!key)
-            break;
+//=============================================================================
+void TimerWheelDestroy (TimerWheel * wheel) {
+    s_critsect.Enter();
+    if (s_nextWheel == wheel)
+        s_nextWheel = NULL;
+    wheel->link.Unlink();
+    s_critsect.Leave();
 
+    // The thread has exited, so deletes posted by other threads can be
+    // applied here. Timers that were never deleted are leaked.
+    MailDeliver(wheel);
+    wheel->expired.UnlinkAll();
+    for (unsigned i = 0; i < LEVEL0_SLOTS; ++i)
+        wheel->level0[i].UnlinkAll();
+    for (unsigned level = 1; level < LEVELS; ++level) {
+        for (unsigned i = 0; i < LEVEL_SLOTS; ++i)
+            wheel->levels[level - 1][i].UnlinkAll();
+    }
+    delete wheel;
+}
+
+//=============================================================================
+void TimerWheelRun (TimerWheel * wheel) {
+    t_wheel = wheel;
+    MailDeliver(wheel);
+    WheelAdvance(wheel, TimeGetMs(), &wheel->expired);
+
+    // Leave the rest of a large burst for the next pass so completions
+    // aren't held up
+    for (unsigned i = 0; i < FIRE_BATCH; ++i) {
+        Timer * timer = wheel->expired.Head();
+        if (!timer)
+            break;
+        timer->m_link.Unlink();
+        Fire(timer);
     }
+}
 
-    return 0;
+//=============================================================================
+unsigned TimerWheelSleepMs (const TimerWheel * wheel) {
+    if (wheel->mailbox || wheel->deletes || wheel->expired.Head())
+        return 0;
+    return WheelNextSleep(wheel, TimeGetMs());
 }
 
 
@@ -130,73 +490,59 @@ static unsigned __stdcall TimerThreadProc (void *) {
 
 //=============================================================================
 void TimerInitialize () {
-    if (NULL == (s_completionPort = CreateIoCompletionPort(
-        INVALID_HANDLE_VALUE,
-        NULL,
-        NULL,
-        0
-    ))) {
-        LOG_OS_LAST_ERROR(L"CreateIoCompletionPort");
-        FatalError();
-    }
-
-    unsigned threadId;
-    if (NULL == (s_timerThread = (HANDLE) _beginthreadex(
-        (LPSECURITY_ATTRIBUTES) NULL,
-        0,      // default stack size
-        TimerThreadProc,
-        NULL,
-        0,      // flags
-        &threadId
-    ))) {
-        LOG_OS_LAST_ERROR(L"_beginthreadex");
-        FatalError();
-    }
+    // Wheels are created with the task threads
 }
 
 //=============================================================================
 void TimerDestroy () {
-    if (s_timerThread) {
-        PostQueuedCompletionStatus(s_completionPort, 0, 0, 0);
-        WaitForSingleObject(s_timerThread, INFINITE);
-        CloseHandle(s_timerThread);
-        s_timerThread = NULL;
-    }
-
-    if (s_completionPort) {
-        CloseHandle(s_completionPort);
-        s_completionPort = NULL;
-    }
+    // Timers deleted from other threads are freed with their wheels
 }
 
 //=============================================================================
 void TimerCreate (
     __in    ITimerCallback *    callback,
     __in    unsigned            sleepMs,
-    __out   ITimer **           timer
+    __out   ITimer **           timer,
+    __in    unsigned            slackMs
 ) {
-    Timer * t       = new Timer;
-    t->m_callback   = callback;
-    t->m_nextTimeMs = TimeGetMs() + sleepMs;
-    t->m_flags      = 0;
+    // Timers created on a task thread belong to it; others are dealt out
+    TimerWheel * wheel = t_wheel;
+    if (!wheel) {
+        s_critsect.Enter();
+        wheel = s_nextWheel ? s_wheels.Next(s_nextWheel) : NULL;
+        if (!wheel)
+            wheel = s_wheels.Head();
+        s_nextWheel = wheel;
+        s_critsect.Leave();
+
+        // TaskInitialize creates the wheels
+        ASSERT(wheel);
+    }
+
+    Timer * t               = new Timer;
+    t->m_wheel              = wheel;
+    t->m_callback           = callback;
+    t->m_expireMs           = 0;
+    t->m_level              = 0;
+    t->m_slackMs            = slackMs;
+    t->m_firing             = false;
+    t->m_deleted            = false;
+    t->m_setWhileFiring     = false;
+    t->m_armWhileFiring     = false;
+    t->m_mail               = 0;
+    t->m_mailQueued         = 0;
+    t->m_deletePosted       = 0;
+    t->m_mailNext           = NULL;
+    t->m_deleteNext         = NULL;
 
     // Set the timer *before* adding it to the queue to avoid a race
     // condition where a callback occurs before the parameter is set.
     *timer = t;
 
-    if (sleepMs == TIMER_INFINITE_MS)
-        return;
-
-    s_critsect.Enter();
-    {
-        t->m_flags |= TIMER_FLAG_QUEUED;
-        s_timerQ.add(t);
-    }
-    s_critsect.Leave();
+    if (sleepMs != TIMER_INFINITE_MS)
+        t->Set(sleepMs);
 }
 
-#endif
-
 
 //===================================
 // MIT License
@@ -14,6 +14,42 @@
 #define TIMER_H
 
 
+/******************************************************************************
+*
+*   WHAT IT IS
+*
+*   One-shot and repeating timers whose callbacks run on the task threads.
+*   Each task thread keeps its timers in its own hierarchical timing wheel,
+*   so setting, resetting and deleting a timer take constant time however
+*   many timers exist, and take no lock on the thread that owns the timer.
+*
+*   Timers that don't need to be exact can be given slack, which lets
+*   their callbacks run up to that much later so that timers with nearby
+*   expiries fire together in one wakeup. Use it for keepalives and idle
+*   checks, where thousands of timers would otherwise wake the thread one
+*   at a time.
+*
+*   A timer belongs to the task thread it was created on, or to one chosen
+*   round-robin if it was created elsewhere, and its callbacks always run
+*   on that thread. Set and Delete from other threads are passed to the
+*   owner through a lock-free mailbox.
+*
+*   HOW TO USE IT
+*
+*       class CSession : public ITimerCallback {
+*           unsigned OnTimer () {
+*               SendKeepAlive();
+*               return KEEPALIVE_MS;    // or TIMER_INFINITE_MS to stop
+*           }
+*       };
+*
+*       TimerCreate(session, KEEPALIVE_MS, &session->m_timer);
+*       ...
+*       session->m_timer->Delete();
+*
+***/
+
+
 /******************************************************************************
 *
 *   Exports
@@ -25,26 +61,60 @@ const unsigned TIMER_INFINITE_MS = (unsigned) -1;
 
 // Your class should derive from this class to receive a callback
 APICLASS ITimerCallback {
+    // Return the time until the next callback, or TIMER_INFINITE_MS to
+    // wait for ITimer::Set. Ignored if Set was called during the callback.
     virtual unsigned OnTimer () = 0;
 };
 
 // When you create a timer you get this timer management object
 APICLASS ITimer {
+    // The callback won't be called again, although it may still be running
+    // on the owning thread when Delete is called from another thread
     virtual void Delete () = 0;
+
+    // Replaces the current expiry; TIMER_INFINITE_MS stops the timer
     virtual void Set (__in unsigned sleepMs) = 0;
+
+    // As above, also replacing the slack, which applies to this and later
+    // expiries including those returned by OnTimer
+    virtual void Set (__in unsigned sleepMs, __in unsigned slackMs) = 0;
 };
 
+// The callback may run up to slackMs late
 void TimerCreate (
     __in    ITimerCallback *    callback,
     __in    unsigned            sleepMs,
-    __out   ITimer **           timer
+    __out   ITimer **           timer,
+    __in    unsigned            slackMs = 0
 );
 
-// Module creation/destruction
+// Module creation/destruction. Call TimerInitialize after TaskInitialize
+// and TimerDestroy before TaskDestroy.
 void TimerInitialize ();
 void TimerDestroy ();
 
 
+/******************************************************************************
+*
+*   Task thread integration
+*
+*   Used by Task.cpp; each task thread runs its wheel between batches of
+*   completions and waits no longer than TimerWheelSleepMs. Other threads
+*   wake the owner with an APC, so its waits must be alertable.
+*
+***/
+
+struct TimerWheel;
+
+// Called before the thread starts, and after it has exited
+TimerWheel * TimerWheelCreate (HANDLE thread);
+void TimerWheelDestroy (TimerWheel * wheel);
+
+// Only called on the owning thread
+void TimerWheelRun (TimerWheel * wheel);
+unsigned TimerWheelSleepMs (const TimerWheel * wheel);
+
+
 //===================================
 // MIT License
 //
@@ -15,12 +15,16 @@
 // System includes
 #define STRICT
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
+#include <WinSock2.h>     // must come before Windows.h
 #include <Windows.h>
+#include <MSWSock.h>
 #include <Shlwapi.h>
 #include <process.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <crtdbg.h>
+#include <intrin.h>
+#include <typeinfo>
 
 // Project includes
 #include "Base.h"
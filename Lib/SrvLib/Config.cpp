@@ -57,6 +57,7 @@ struct DirMonitor : public CTask {
     ConfigFileMap    m_files;
     OVERLAPPED        m_olap;
     HANDLE            m_handle;
+    bool            m_destroying;
     wchar            m_directory[MAX_PATH];
     byte            m_buffer[2*1024];
 
@@ -121,6 +122,7 @@ struct DeleteConfigFile {
 //===================================
 DirMonitor::DirMonitor (const wchar directory[])
 :   m_handle(INVALID_HANDLE_VALUE)
+,   m_destroying(false)
 {
     StrCopy(m_directory, _countof(m_directory), directory);
     ZERO(m_olap);
@@ -149,16 +151,19 @@ struct DestroyDirMonitor_CS {
 
 //===================================
 void DirMonitor::Destroy_CS () {
-    // Closing the handle will initiate an asynchronous callback
-    HANDLE handle   = m_handle;
-    m_handle        = INVALID_HANDLE_VALUE;
-    CloseHandle(handle);
+    // Cancelling the pending read makes it complete; the completion closes
+    // the handle and deletes the monitor. If the read has already completed
+    // there's nothing to cancel and that completion does the same.
+    m_destroying = true;
+    TaskCancel(m_handle, &m_olap);
 }
 
 
 //===================================
 void DirMonitor::WatchDirectory_CS () {
-    if (m_handle == INVALID_HANDLE_VALUE) {
+    if (m_destroying) {
+        CloseHandle(m_handle);
+        m_handle = INVALID_HANDLE_VALUE;
         delete this;
     }
     else if (!ReadDirectoryChangesW(
@@ -254,7 +259,7 @@ void DirMonitor::TaskComplete (
 ) {
     s_critsect.Enter();
     {
-        if (m_handle == INVALID_HANDLE_VALUE) {
+        if (m_destroying) {
             // The monitor is ready to be deleted
         }
         // If no bytes read then m_buffer wasn't large enough to hold all the
@@ -291,6 +291,7 @@ static int ApplicationRun (bool serviceMode) {
     if (!serviceMode)
         MainWndInitialize(s_app->Name());
     TaskInitialize();
+    TimerInitialize();
     ConfigInitialize();
     ConfigMonitorFile(L"Config\\Srv.ini");
     s_app->Start(&sp);
@@ -303,6 +304,7 @@ static int ApplicationRun (bool serviceMode) {
     sp.SetState(SERVICE_STOP_PENDING);
     s_app->Stop();
     ConfigDestroy();
+    TimerDestroy();
     TaskDestroy();
     MainWndDestroy();
 
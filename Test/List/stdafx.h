@@ -13,6 +13,7 @@
 
 
 // TODO: reference additional headers your program requires here
+#include <WinSock2.h>     // must come before Windows.h
 #include <Windows.h>
 #include <stdlib.h>
 #include <malloc.h>
@@ -6,6 +6,7 @@
 #pragma once
 
 #include "targetver.h"
+#include <WinSock2.h>     // must come before Windows.h
 #include <Windows.h>
 #include <process.h>
 
@@ -18,6 +18,7 @@
 // System includes
 #pragma warning(push, 1)
 #define STRICT
+#include <WinSock2.h>     // must come before Windows.h
 #include <windows.h>
 #include <shlwapi.h>
 #include <process.h>
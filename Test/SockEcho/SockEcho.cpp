@@ -0,0 +1,919 @@
+// SockEcho.cpp : Echoes data over loopback connections and checks it
+//
+
+#include "stdafx.h"
+#pragma hdrstop
+
+
+/******************************************************************************
+*
+*   Echo test
+*
+*   Each client connects to a listener on 127.0.0.1, sends MESSAGES small
+*   messages and checks that the byte stream echoed back is identical.
+*
+***/
+
+namespace Echo {
+
+static const unsigned CLIENTS       = 32;
+static const unsigned MESSAGES      = 1000;
+static const unsigned MESSAGE_BYTES = 37;   // not a divisor of the buffer size
+static const unsigned TOTAL_BYTES   = MESSAGES * MESSAGE_BYTES;
+
+static volatile long    s_remaining;
+static volatile long    s_failures;
+static HANDLE           s_doneEvt;
+
+//=============================================================================
+static inline byte PatternByte (unsigned client, unsigned offset) {
+    return (byte) (offset * 7 + client);
+}
+
+//=============================================================================
+class CServer : public ISockListenNotify, public ISockNotify {
+public:
+    ISockNotify * OnSockAccept (const sockaddr_in &) {
+        return this;
+    }
+
+    void OnSockConnect (ISock *) {
+    }
+
+    // Echo the receive buffer itself rather than a copy of it
+    void OnSockRead (ISock * sock, const byte data[], unsigned bytes) {
+        CIoChain chain;
+        sock->AppendRead(data, bytes, &chain);
+        sock->Send(&chain);
+    }
+
+    void OnSockDisconnect (ISock *) {
+    }
+};
+
+//=============================================================================
+class CClient : public ISockNotify {
+public:
+    unsigned    m_index;
+    unsigned    m_received;
+    bool        m_failed;
+
+    CClient () : m_index(0), m_received(0), m_failed(false) {}
+
+    void OnSockConnect (ISock * sock) {
+        byte message[MESSAGE_BYTES];
+        for (unsigned i = 0; i < MESSAGES; ++i) {
+            for (unsigned j = 0; j < MESSAGE_BYTES; ++j)
+                message[j] = PatternByte(m_index, i * MESSAGE_BYTES + j);
+            sock->Send(message, sizeof(message));
+        }
+    }
+
+    void OnSockRead (ISock * sock, const byte data[], unsigned bytes) {
+        for (unsigned i = 0; i < bytes; ++i) {
+            if (m_received >= TOTAL_BYTES || data[i] != PatternByte(m_index, m_received)) {
+                m_failed = true;
+                break;
+            }
+            ++m_received;
+        }
+
+        if (m_failed || m_received == TOTAL_BYTES)
+            sock->Disconnect();
+    }
+
+    void OnSockDisconnect (ISock *) {
+        if (m_failed || m_received != TOTAL_BYTES) {
+            printf("client %u: failed after %u of %u bytes\n", m_index, m_received, TOTAL_BYTES);
+            InterlockedIncrement(&s_failures);
+        }
+        if (!InterlockedDecrement(&s_remaining))
+            SetEvent(s_doneEvt);
+    }
+};
+
+//=============================================================================
+static bool Run () {
+    CServer server;
+    sockaddr_in addr;
+    ZERO(addr);
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    addr.sin_port           = 0;
+
+    ISockListener * listener;
+    if (!SockListen(addr, &server, &listener)) {
+        printf("listen failed\n");
+        return false;
+    }
+    addr.sin_port = htons((unsigned short) listener->GetPort());
+
+    s_doneEvt   = CreateEvent(NULL, true, false, NULL);
+    s_remaining = CLIENTS;
+    s_failures  = 0;
+
+    CClient * clients = new CClient[CLIENTS];
+    for (unsigned i = 0; i < CLIENTS; ++i) {
+        clients[i].m_index = i;
+        SockConnect(addr, &clients[i]);
+    }
+
+    bool done = WAIT_OBJECT_0 == WaitForSingleObject(s_doneEvt, 30 * 1000);
+    if (!done)
+        printf("timed out with %u clients remaining\n", (unsigned) s_remaining);
+
+    // SockDestroy disconnects anything left, so the clients outlive it
+    listener->Close();
+    SockDestroy();
+    delete [] clients;
+    CloseHandle(s_doneEvt);
+    return done && !s_failures;
+}
+
+}   // namespace Echo
+
+
+/******************************************************************************
+*
+*   Framed echo test
+*
+*   Like the echo test, but with length-prefixed messages of varying sizes,
+*   some larger than a receive buffer, so that messages arrive both whole
+*   and split across receives.
+*
+***/
+
+namespace Framed {
+
+static const unsigned CLIENTS       = 16;
+static const unsigned MESSAGES      = 500;
+static const unsigned MAX_MSG_BYTES = 6000;
+
+static volatile long    s_remaining;
+static volatile long    s_failures;
+static HANDLE           s_doneEvt;
+
+//=============================================================================
+static inline unsigned MessageBytes (unsigned msg) {
+    return (msg * 131) % MAX_MSG_BYTES;
+}
+
+//=============================================================================
+static inline byte PatternByte (unsigned client, unsigned msg, unsigned offset) {
+    return (byte) (offset * 5 + msg + client);
+}
+
+#pragma warning(disable:4355)   // 'this' used in base member initializer list
+
+//=============================================================================
+class CServerConn : public ISockNotify, public ISockMsgNotify {
+public:
+    CServerConn () : m_framer(this, MAX_MSG_BYTES) {}
+
+    void OnSockConnect (ISock *) {
+    }
+
+    void OnSockRead (ISock * sock, const byte data[], unsigned bytes) {
+        if (!m_framer.Read(sock, data, bytes))
+            sock->Disconnect();
+    }
+
+    void OnSockMsg (ISock * sock, const byte msg[], unsigned bytes) {
+        SockSendMsg(sock, msg, bytes);
+    }
+
+    void OnSockDisconnect (ISock *) {
+        delete this;
+    }
+
+private:
+    CSockFramer m_framer;
+};
+
+//=============================================================================
+class CServer : public ISockListenNotify {
+public:
+    ISockNotify * OnSockAccept (const sockaddr_in &) {
+        return new CServerConn;
+    }
+};
+
+//=============================================================================
+class CClient : public ISockNotify, public ISockMsgNotify {
+public:
+    unsigned    m_index;
+    unsigned    m_received;
+    bool        m_failed;
+
+    CClient () : m_index(0), m_received(0), m_failed(false), m_framer(this, MAX_MSG_BYTES) {}
+
+    void OnSockConnect (ISock * sock) {
+        byte message[MAX_MSG_BYTES];
+        for (unsigned i = 0; i < MESSAGES; ++i) {
+            unsigned bytes = MessageBytes(i);
+            for (unsigned j = 0; j < bytes; ++j)
+                message[j] = PatternByte(m_index, i, j);
+            SockSendMsg(sock, message, bytes);
+        }
+    }
+
+    void OnSockRead (ISock * sock, const byte data[], unsigned bytes) {
+        if (!m_framer.Read(sock, data, bytes))
+            m_failed = true;
+        if (m_failed || m_received == MESSAGES)
+            sock->Disconnect();
+    }
+
+    void OnSockMsg (ISock *, const byte msg[], unsigned bytes) {
+        if (m_failed)
+            return;
+        if (m_received >= MESSAGES || bytes != MessageBytes(m_received)) {
+            m_failed = true;
+            return;
+        }
+        for (unsigned j = 0; j < bytes; ++j) {
+            if (msg[j] != PatternByte(m_index, m_received, j)) {
+                m_failed = true;
+                return;
+            }
+        }
+        ++m_received;
+    }
+
+    void OnSockDisconnect (ISock *) {
+        if (m_failed || m_received != MESSAGES) {
+            printf("client %u: failed after %u of %u messages\n", m_index, m_received, MESSAGES);
+            InterlockedIncrement(&s_failures);
+        }
+        if (!InterlockedDecrement(&s_remaining))
+            SetEvent(s_doneEvt);
+    }
+
+private:
+    CSockFramer m_framer;
+};
+
+#pragma warning(default:4355)   // 'this' used in base member initializer list
+
+//=============================================================================
+static bool Run () {
+    CServer server;
+    sockaddr_in addr;
+    ZERO(addr);
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    addr.sin_port           = 0;
+
+    ISockListener * listener;
+    if (!SockListen(addr, &server, &listener)) {
+        printf("listen failed\n");
+        return false;
+    }
+    addr.sin_port = htons((unsigned short) listener->GetPort());
+
+    s_doneEvt   = CreateEvent(NULL, true, false, NULL);
+    s_remaining = CLIENTS;
+    s_failures  = 0;
+
+    CClient * clients = new CClient[CLIENTS];
+    for (unsigned i = 0; i < CLIENTS; ++i) {
+        clients[i].m_index = i;
+        SockConnect(addr, &clients[i]);
+    }
+
+    bool done = WAIT_OBJECT_0 == WaitForSingleObject(s_doneEvt, 30 * 1000);
+    if (!done)
+        printf("timed out with %u clients remaining\n", (unsigned) s_remaining);
+
+    // SockDestroy disconnects anything left, so the clients outlive it
+    listener->Close();
+    SockDestroy();
+    delete [] clients;
+    CloseHandle(s_doneEvt);
+    return done && !s_failures;
+}
+
+}   // namespace Framed
+
+
+/******************************************************************************
+*
+*   UDP batch test
+*
+*   Every task thread is kept busy while one endpoint sends a burst of
+*   datagrams to another, so the receives complete while no thread is
+*   waiting on the port. The thread that dequeues them gets several in one
+*   batch, and they must be delivered together in one OnUdpRecv call.
+*
+***/
+
+namespace Udp {
+
+static const unsigned DATAGRAMS         = 16;
+static const unsigned DATAGRAM_BYTES    = 100;
+
+static volatile long    s_received;
+static volatile long    s_largestBatch;
+static volatile long    s_failures;
+static volatile long    s_seen[DATAGRAMS];
+static HANDLE           s_doneEvt;
+static HANDLE           s_stalledEvt;   // a thread is stalled
+static HANDLE           s_resumeEvt;
+
+//=============================================================================
+// The first byte of each datagram is its index
+static inline byte PatternByte (unsigned datagram, unsigned offset) {
+    return (byte) (offset * 3 + datagram);
+}
+
+//=============================================================================
+class CEndpoint : public IUdpNotify {
+public:
+    void OnUdpRecv (IUdpSock *, const UdpDatagram datagrams[], unsigned count) {
+        for (long largest = s_largestBatch; (long) count > largest; largest = s_largestBatch) {
+            if (InterlockedCompareExchange(&s_largestBatch, (long) count, largest) == largest)
+                break;
+        }
+
+        for (unsigned i = 0; i < count; ++i) {
+            const UdpDatagram & datagram = datagrams[i];
+            unsigned index = datagram.bytes ? datagram.data[0] : DATAGRAMS;
+            bool valid = datagram.bytes == DATAGRAM_BYTES && index < DATAGRAMS;
+            for (unsigned j = 0; valid && j < datagram.bytes; ++j)
+                valid = datagram.data[j] == PatternByte(index, j);
+            if (!valid || InterlockedIncrement(&s_seen[index]) != 1)
+                InterlockedIncrement(&s_failures);
+            if (InterlockedIncrement(&s_received) == DATAGRAMS)
+                SetEvent(s_doneEvt);
+        }
+    }
+
+    void OnUdpClose (IUdpSock *) {
+    }
+};
+
+//=============================================================================
+static void StallProc (void *) {
+    SetEvent(s_stalledEvt);
+    WaitForSingleObject(s_resumeEvt, INFINITE);
+}
+
+//=============================================================================
+static bool Run () {
+    CEndpoint endpoint;
+    sockaddr_in addr;
+    ZERO(addr);
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    addr.sin_port           = 0;
+
+    IUdpSock * receiver;
+    IUdpSock * sender;
+    if (!SockUdpOpen(addr, &endpoint, &receiver)) {
+        printf("UDP open failed\n");
+        SockDestroy();
+        return false;
+    }
+    if (!SockUdpOpen(addr, &endpoint, &sender)) {
+        printf("UDP open failed\n");
+        receiver->Close();
+        SockDestroy();
+        return false;
+    }
+    addr.sin_port = htons((unsigned short) receiver->GetPort());
+
+    s_doneEvt       = CreateEvent(NULL, true, false, NULL);
+    s_stalledEvt    = CreateEvent(NULL, false, false, NULL);
+    s_resumeEvt     = CreateEvent(NULL, true, false, NULL);
+    s_received      = 0;
+    s_largestBatch  = 0;
+    s_failures      = 0;
+    for (unsigned i = 0; i < DATAGRAMS; ++i)
+        s_seen[i] = 0;
+
+    // Stall the threads one at a time; a thread that dequeued two stalls
+    // in one batch would never start the second
+    TaskStats stats;
+    TaskGetStats(&stats);
+    TaskWork * stalls = new TaskWork[stats.threads];
+    for (unsigned i = 0; i < stats.threads; ++i) {
+        TaskPost(&stalls[i], StallProc, NULL);
+        if (WAIT_OBJECT_0 != WaitForSingleObject(s_stalledEvt, 30 * 1000)) {
+            printf("only %u of %u task threads stalled\n", i, stats.threads);
+            break;
+        }
+    }
+
+    byte data[DATAGRAMS][DATAGRAM_BYTES];
+    UdpDatagram datagrams[DATAGRAMS];
+    for (unsigned i = 0; i < DATAGRAMS; ++i) {
+        for (unsigned j = 0; j < DATAGRAM_BYTES; ++j)
+            data[i][j] = PatternByte(i, j);
+        datagrams[i].data   = data[i];
+        datagrams[i].bytes  = DATAGRAM_BYTES;
+        datagrams[i].addr   = addr;
+    }
+    sender->Send(datagrams, DATAGRAMS);
+
+    // Give the receives time to complete before releasing the threads
+    Sleep(100);
+    SetEvent(s_resumeEvt);
+
+    bool done = WAIT_OBJECT_0 == WaitForSingleObject(s_doneEvt, 30 * 1000);
+    if (!done)
+        printf("received %u of %u datagrams\n", (unsigned) s_received, DATAGRAMS);
+    else if (s_largestBatch < 2)
+        printf("datagrams were never delivered together\n");
+
+    receiver->Close();
+    sender->Close();
+    SockDestroy();
+    delete [] stalls;
+    CloseHandle(s_doneEvt);
+    CloseHandle(s_stalledEvt);
+    CloseHandle(s_resumeEvt);
+    return done && s_largestBatch >= 2 && !s_failures;
+}
+
+}   // namespace Udp
+
+
+/******************************************************************************
+*
+*   File test
+*
+*   Writes blocks of a temporary file out of order with unbuffered I/O,
+*   reads them back at their offsets, and reads once past the end.
+*
+***/
+
+namespace FileIo {
+
+static const unsigned BLOCKS        = 16;
+static const unsigned BLOCK_BYTES   = FILE_ALIGN_BYTES;
+static const unsigned PAST_END      = BLOCKS;   // the read past the end
+
+//=============================================================================
+static inline byte PatternByte (unsigned block, unsigned offset) {
+    return (byte) (offset * 11 + block);
+}
+
+//=============================================================================
+class CFile : public CTask {
+public:
+    OVERLAPPED      m_olaps[BLOCKS + 1];
+    unsigned        m_bytes[BLOCKS + 1];
+    bool            m_failed[BLOCKS + 1];
+    volatile long   m_remaining;
+    HANDLE          m_doneEvt;
+
+    void Complete (unsigned index, unsigned bytes, bool failed) {
+        m_bytes[index]  = bytes;
+        m_failed[index] = failed;
+        if (!InterlockedDecrement(&m_remaining))
+            SetEvent(m_doneEvt);
+    }
+
+    void TaskComplete (unsigned bytes, OVERLAPPED * olap) {
+        Complete((unsigned) (olap - m_olaps), bytes, FileOpFailed(olap));
+    }
+};
+
+//=============================================================================
+static bool Run () {
+    wchar dir[MAX_PATH];
+    wchar path[MAX_PATH];
+    if (!GetTempPathW(_countof(dir), dir) || !GetTempFileNameW(dir, L"coh", 0, path)) {
+        printf("no temporary file\n");
+        return false;
+    }
+
+    CFile file;
+    file.m_doneEvt = CreateEvent(NULL, false, false, NULL);
+    HANDLE handle = FileOpenAsync(
+        path,
+        FILE_OPEN_READ | FILE_OPEN_WRITE | FILE_OPEN_CREATE | FILE_OPEN_TRUNCATE | FILE_OPEN_UNBUFFERED,
+        &file
+    );
+    if (handle == INVALID_HANDLE_VALUE) {
+        printf("open failed: %u\n", GetLastError());
+        CloseHandle(file.m_doneEvt);
+        DeleteFileW(path);
+        return false;
+    }
+
+    byte * buffers[BLOCKS + 1];
+    for (unsigned i = 0; i <= BLOCKS; ++i)
+        buffers[i] = (byte *) FileBufferAlloc(BLOCK_BYTES);
+
+    // Last block first, all at once, so the writes complete out of order
+    bool passed = true;
+    file.m_remaining = BLOCKS;
+    for (unsigned i = BLOCKS; i--; ) {
+        for (unsigned j = 0; j < BLOCK_BYTES; ++j)
+            buffers[i][j] = PatternByte(i, j);
+        if (!FileWriteAsync(handle, (u64) i * BLOCK_BYTES, buffers[i], BLOCK_BYTES, &file.m_olaps[i]))
+            file.Complete(i, 0, true);
+    }
+    bool done = WAIT_OBJECT_0 == WaitForSingleObject(file.m_doneEvt, 30 * 1000);
+    for (unsigned i = 0; done && i < BLOCKS; ++i) {
+        if (file.m_failed[i] || file.m_bytes[i] != BLOCK_BYTES) {
+            printf("write %u: wrote %u bytes\n", i, file.m_bytes[i]);
+            passed = false;
+        }
+    }
+    if (done && FileGetSize(handle) != (u64) BLOCKS * BLOCK_BYTES) {
+        printf("file is %u bytes\n", (unsigned) FileGetSize(handle));
+        passed = false;
+    }
+
+    // Read back every block, and once at the end of the file
+    if (done) {
+        file.m_remaining = BLOCKS + 1;
+        for (unsigned i = 0; i <= BLOCKS; ++i) {
+            memset(buffers[i], 0, BLOCK_BYTES);
+            if (FileReadAsync(handle, (u64) i * BLOCK_BYTES, buffers[i], BLOCK_BYTES, &file.m_olaps[i]))
+                continue;
+            bool endOfFile = i == PAST_END && GetLastError() == ERROR_HANDLE_EOF;
+            file.Complete(i, 0, !endOfFile);
+        }
+        done = WAIT_OBJECT_0 == WaitForSingleObject(file.m_doneEvt, 30 * 1000);
+    }
+    for (unsigned i = 0; done && i < BLOCKS; ++i) {
+        bool valid = !file.m_failed[i] && file.m_bytes[i] == BLOCK_BYTES;
+        for (unsigned j = 0; valid && j < BLOCK_BYTES; ++j)
+            valid = buffers[i][j] == PatternByte(i, j);
+        if (!valid) {
+            printf("read %u: data differs\n", i);
+            passed = false;
+        }
+    }
+    if (done && (file.m_failed[PAST_END] || file.m_bytes[PAST_END])) {
+        printf("read past the end: %u bytes\n", file.m_bytes[PAST_END]);
+        passed = false;
+    }
+    if (!done)
+        printf("timed out with %u file operations remaining\n", (unsigned) file.m_remaining);
+
+    // Operations still pending complete with errors once the file closes
+    FileClose(handle);
+    if (!done)
+        WaitForSingleObject(file.m_doneEvt, 30 * 1000);
+    for (unsigned i = 0; i <= BLOCKS; ++i)
+        FileBufferFree(buffers[i], BLOCK_BYTES);
+    CloseHandle(file.m_doneEvt);
+    DeleteFileW(path);
+    return done && passed;
+}
+
+}   // namespace FileIo
+
+
+/******************************************************************************
+*
+*   File send test
+*
+*   A client sends a range of a temporary file between two ordinary sends
+*   to an echo server, and checks that the echoed stream is the first
+*   send, the file range byte for byte, then the second send.
+*
+***/
+
+namespace SendFile {
+
+static const unsigned FILE_BYTES    = 512 * 1024;
+static const unsigned RANGE_OFFSET  = 1000;     // not aligned
+static const unsigned RANGE_BYTES   = 300 * 1000;
+static const unsigned PREFIX_BYTES  = 100;
+static const unsigned SUFFIX_BYTES  = 100;
+static const unsigned TOTAL_BYTES   = PREFIX_BYTES + RANGE_BYTES + SUFFIX_BYTES;
+
+static HANDLE           s_doneEvt;
+
+//=============================================================================
+static inline byte FileByte (unsigned offset) {
+    return (byte) (offset + offset / 251);
+}
+
+//=============================================================================
+// The byte expected at this offset of the echoed stream
+static inline byte StreamByte (unsigned offset) {
+    if (offset < PREFIX_BYTES)
+        return (byte) ~offset;
+    offset -= PREFIX_BYTES;
+    if (offset < RANGE_BYTES)
+        return FileByte(RANGE_OFFSET + offset);
+    return (byte) (offset - RANGE_BYTES);
+}
+
+//=============================================================================
+class CServer : public ISockListenNotify, public ISockNotify {
+public:
+    ISockNotify * OnSockAccept (const sockaddr_in &) {
+        return this;
+    }
+
+    void OnSockConnect (ISock *) {
+    }
+
+    void OnSockRead (ISock * sock, const byte data[], unsigned bytes) {
+        sock->Send(data, bytes);
+    }
+
+    void OnSockDisconnect (ISock *) {
+    }
+};
+
+//=============================================================================
+class CClient : public ISockNotify {
+public:
+    HANDLE      m_file;
+    unsigned    m_received;
+    bool        m_failed;
+    bool        m_fileSent;
+    bool        m_fileFailed;
+
+    CClient (HANDLE file)
+    :   m_file(file)
+    ,   m_received(0)
+    ,   m_failed(false)
+    ,   m_fileSent(false)
+    ,   m_fileFailed(false)
+    {}
+
+    void OnSockConnect (ISock * sock) {
+        byte prefix[PREFIX_BYTES];
+        for (unsigned i = 0; i < PREFIX_BYTES; ++i)
+            prefix[i] = StreamByte(i);
+        byte suffix[SUFFIX_BYTES];
+        for (unsigned i = 0; i < SUFFIX_BYTES; ++i)
+            suffix[i] = StreamByte(PREFIX_BYTES + RANGE_BYTES + i);
+
+        sock->Send(prefix, sizeof(prefix));
+        sock->SendFile(m_file, RANGE_OFFSET, RANGE_BYTES, this);
+        sock->Send(suffix, sizeof(suffix));
+    }
+
+    void OnSockRead (ISock * sock, const byte data[], unsigned bytes) {
+        for (unsigned i = 0; i < bytes; ++i) {
+            if (m_received >= TOTAL_BYTES || data[i] != StreamByte(m_received)) {
+                m_failed = true;
+                break;
+            }
+            ++m_received;
+        }
+
+        if (m_failed || m_received == TOTAL_BYTES)
+            sock->Disconnect();
+    }
+
+    void OnSockFileSent (ISock *, void * context, bool failed) {
+        m_fileSent   = context == this;
+        m_fileFailed = failed;
+    }
+
+    void OnSockDisconnect (ISock *) {
+        if (m_failed || m_received != TOTAL_BYTES)
+            printf("file send: failed after %u of %u bytes\n", m_received, TOTAL_BYTES);
+        if (!m_fileSent || m_fileFailed)
+            printf("file send: range not reported sent\n");
+        SetEvent(s_doneEvt);
+    }
+
+    bool Passed () const {
+        return !m_failed && m_received == TOTAL_BYTES && m_fileSent && !m_fileFailed;
+    }
+};
+
+//=============================================================================
+static HANDLE CreateTempFile (wchar path[MAX_PATH]) {
+    wchar dir[MAX_PATH];
+    if (!GetTempPathW(MAX_PATH, dir) || !GetTempFileNameW(dir, L"coh", 0, path))
+        return INVALID_HANDLE_VALUE;
+
+    HANDLE file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return file;
+
+    byte block[4 * 1024];
+    for (unsigned offset = 0; offset < FILE_BYTES; offset += sizeof(block)) {
+        for (unsigned i = 0; i < sizeof(block); ++i)
+            block[i] = FileByte(offset + i);
+        DWORD written;
+        if (!WriteFile(file, block, sizeof(block), &written, NULL) || written != sizeof(block)) {
+            CloseHandle(file);
+            return INVALID_HANDLE_VALUE;
+        }
+    }
+    return file;
+}
+
+//=============================================================================
+static bool Run () {
+    wchar path[MAX_PATH];
+    HANDLE file = CreateTempFile(path);
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("file send: no temporary file\n");
+        SockDestroy();
+        return false;
+    }
+
+    CServer server;
+    sockaddr_in addr;
+    ZERO(addr);
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    addr.sin_port           = 0;
+
+    ISockListener * listener;
+    if (!SockListen(addr, &server, &listener)) {
+        printf("listen failed\n");
+        SockDestroy();
+        CloseHandle(file);
+        DeleteFileW(path);
+        return false;
+    }
+    addr.sin_port = htons((unsigned short) listener->GetPort());
+
+    s_doneEvt = CreateEvent(NULL, true, false, NULL);
+    CClient client(file);
+    SockConnect(addr, &client);
+
+    bool done = WAIT_OBJECT_0 == WaitForSingleObject(s_doneEvt, 30 * 1000);
+    if (!done)
+        printf("file send: timed out after %u of %u bytes\n", client.m_received, TOTAL_BYTES);
+
+    // SockDestroy disconnects anything left, so the client outlives it
+    listener->Close();
+    SockDestroy();
+    CloseHandle(s_doneEvt);
+    CloseHandle(file);
+    DeleteFileW(path);
+    return done && client.Passed();
+}
+
+}   // namespace SendFile
+
+
+/******************************************************************************
+*
+*   Read timeout test
+*
+*   A client with a read timeout connects to a server that never sends,
+*   and must be disconnected once the timeout passes. Deadlines are checked
+*   every 100ms, so the disconnect may come that much late, plus some
+*   scheduling delay. They're measured with the coarse clock, which can
+*   trail TimeGetMs by a system tick, so it may also come a little early.
+*
+***/
+
+namespace Timeout {
+
+static const unsigned READ_TIMEOUT_MS   = 300;
+static const unsigned LATE_MS           = 100 + 200;
+static const unsigned EARLY_MS          = 20;
+
+static HANDLE           s_doneEvt;
+
+//=============================================================================
+class CServer : public ISockListenNotify, public ISockNotify {
+public:
+    ISockNotify * OnSockAccept (const sockaddr_in &) {
+        return this;
+    }
+
+    void OnSockConnect (ISock *) {
+    }
+
+    void OnSockRead (ISock *, const byte[], unsigned) {
+    }
+
+    void OnSockDisconnect (ISock *) {
+    }
+};
+
+//=============================================================================
+class CClient : public ISockNotify {
+public:
+    unsigned    m_connectMs;
+    unsigned    m_disconnectMs;
+    bool        m_connected;
+    bool        m_read;
+
+    CClient () : m_connectMs(0), m_disconnectMs(0), m_connected(false), m_read(false) {}
+
+    void OnSockConnect (ISock * sock) {
+        m_connected = true;
+        m_connectMs = TimeGetMs();
+        sock->SetTimeouts(READ_TIMEOUT_MS, 0);
+    }
+
+    void OnSockRead (ISock *, const byte[], unsigned) {
+        m_read = true;
+    }
+
+    void OnSockDisconnect (ISock *) {
+        m_disconnectMs = TimeGetMs();
+        SetEvent(s_doneEvt);
+    }
+};
+
+//=============================================================================
+static bool Run () {
+    CServer server;
+    sockaddr_in addr;
+    ZERO(addr);
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    addr.sin_port           = 0;
+
+    ISockListener * listener;
+    if (!SockListen(addr, &server, &listener)) {
+        printf("listen failed\n");
+        SockDestroy();
+        return false;
+    }
+    addr.sin_port = htons((unsigned short) listener->GetPort());
+
+    s_doneEvt = CreateEvent(NULL, true, false, NULL);
+    CClient client;
+    SockConnect(addr, &client);
+
+    bool passed = WAIT_OBJECT_0 == WaitForSingleObject(s_doneEvt, 30 * 1000);
+    if (!passed) {
+        printf("read timeout: never disconnected\n");
+    }
+    else if (!client.m_connected || client.m_read) {
+        printf("read timeout: connect failed or data arrived\n");
+        passed = false;
+    }
+    else {
+        unsigned elapsed = client.m_disconnectMs - client.m_connectMs;
+        if (elapsed + EARLY_MS < READ_TIMEOUT_MS || elapsed > READ_TIMEOUT_MS + LATE_MS) {
+            printf("read timeout: disconnected after %u of %u ms\n", elapsed, READ_TIMEOUT_MS);
+            passed = false;
+        }
+    }
+
+    // SockDestroy disconnects the server's side, so the objects outlive it
+    listener->Close();
+    SockDestroy();
+    CloseHandle(s_doneEvt);
+    return passed;
+}
+
+}   // namespace Timeout
+
+
+/******************************************************************************
+*
+*   Main
+*
+***/
+
+//=============================================================================
+int _tmain(int argc, _TCHAR* argv[]) {
+    TaskInitialize();
+
+    // Each test destroys the socket module to clean up its connections
+    SockInitialize();
+    bool passed = Echo::Run();
+    SockInitialize();
+    passed = Framed::Run() && passed;
+    SockInitialize();
+    passed = Udp::Run() && passed;
+    passed = FileIo::Run() && passed;
+    SockInitialize();
+    passed = SendFile::Run() && passed;
+    SockInitialize();
+    passed = Timeout::Run() && passed;
+    printf("%s\n", passed ? "PASS" : "FAIL");
+
+    TaskDestroy();
+    return passed ? 0 : 1;
+}
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================
@@ -0,0 +1,134 @@
+// TaskBench.cpp : Measures fan-out work posted from task callbacks
+//
+
+#include "stdafx.h"
+#pragma hdrstop
+
+
+/******************************************************************************
+*
+*   Fan-out benchmark
+*
+*   Each root job is posted from the main thread and, when it runs, posts
+*   FAN_OUT leaf jobs from inside its callback. With work stealing the leaves
+*   are queued on the thread running the root; without it every leaf goes
+*   through the shared completion port.
+*
+***/
+
+namespace FanOut {
+
+static const unsigned ROOT_JOBS = 2000;
+static const unsigned FAN_OUT   = 64;
+static const unsigned LEAF_SPIN = 2000;
+
+//=============================================================================
+struct Root {
+    TaskWork    work;
+    TaskWork    leaves[FAN_OUT];
+};
+
+static volatile long    s_remaining;
+static HANDLE           s_doneEvt;
+
+//=============================================================================
+static void LeafProc (void *) {
+    // Simulate a small amount of CPU work
+    volatile unsigned sum = 0;
+    for (unsigned i = 0; i < LEAF_SPIN; ++i)
+        sum += i;
+
+    if (!InterlockedDecrement(&s_remaining))
+        SetEvent(s_doneEvt);
+}
+
+//=============================================================================
+static void RootProc (void * context) {
+    Root * root = (Root *) context;
+    for (unsigned i = 0; i < FAN_OUT; ++i)
+        TaskPost(&root->leaves[i], LeafProc, NULL);
+}
+
+//=============================================================================
+static void Run (bool workStealing) {
+    TaskConfig config;
+    config.workStealing = workStealing;
+    TaskInitialize(config);
+
+    Root * roots = new Root[ROOT_JOBS];
+    s_remaining = ROOT_JOBS * FAN_OUT;
+    ResetEvent(s_doneEvt);
+
+    LARGE_INTEGER freq, start, end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    for (unsigned i = 0; i < ROOT_JOBS; ++i)
+        TaskPost(&roots[i].work, RootProc, &roots[i]);
+    WaitForSingleObject(s_doneEvt, INFINITE);
+    QueryPerformanceCounter(&end);
+
+    TaskStats stats;
+    TaskGetStats(&stats);
+    TaskDestroy();
+    delete [] roots;
+
+    double ms = (double) (end.QuadPart - start.QuadPart) * 1000.0 / (double) freq.QuadPart;
+    printf(
+        "%-14s %u threads, %u jobs: %8.2f ms, %8.0f jobs/ms, %I64u batches, %I64u steals\n",
+        workStealing ? "work-stealing" : "central queue",
+        stats.threads,
+        ROOT_JOBS * FAN_OUT,
+        ms,
+        (double) (ROOT_JOBS * FAN_OUT) / ms,
+        stats.batches,
+        stats.steals
+    );
+}
+
+}   // namespace FanOut
+
+
+/******************************************************************************
+*
+*   Main
+*
+***/
+
+//=============================================================================
+int _tmain(int argc, _TCHAR* argv[]) {
+    FanOut::s_doneEvt = CreateEvent(NULL, true, false, NULL);
+
+    // Alternate so neither mode benefits from running second
+    for (unsigned pass = 0; pass < 3; ++pass) {
+        FanOut::Run(false);
+        FanOut::Run(true);
+    }
+
+    CloseHandle(FanOut::s_doneEvt);
+    return 0;
+}
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================
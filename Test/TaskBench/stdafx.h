@@ -0,0 +1,23 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include "targetver.h"
+
+#include <stdio.h>
+#include <tchar.h>
+
+
+
+// TODO: reference additional headers your program requires here
+#include <WinSock2.h>     // must come before Windows.h
+#include <Windows.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <crtdbg.h>
+
+#include "../../Base/Base.h"
@@ -0,0 +1,471 @@
+// TimerWheel.cpp : Checks timer expiry order and timing across the wheel levels
+//
+
+#include "stdafx.h"
+#pragma hdrstop
+
+
+/******************************************************************************
+*
+*   Common
+*
+*   Waits on the task threads are limited by the system timer resolution,
+*   so a callback may run up to one system tick (~16ms) late even when the
+*   thread is idle; LATE_MS allows for that and some scheduling delay.
+*
+***/
+
+static const unsigned LATE_MS = 40;
+
+static volatile long s_failures;
+
+//=============================================================================
+static void __cdecl Fail (const char fmt[], ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    InterlockedIncrement(&s_failures);
+}
+
+//=============================================================================
+// Checks that a timer expected "expireMs" after startMs fired within
+// [expireMs, expireMs + lateMs]
+static void CheckFired (
+    const char  name[],
+    unsigned    index,
+    unsigned    startMs,
+    unsigned    firedMs,
+    unsigned    expireMs,
+    unsigned    lateMs
+) {
+    int elapsed = (int) (firedMs - startMs);
+    if (elapsed < (int) expireMs)
+        Fail("%s %u: fired early, after %d of %u ms\n", name, index, elapsed, expireMs);
+    else if (elapsed > (int) (expireMs + lateMs))
+        Fail("%s %u: fired late, after %d of %u ms\n", name, index, elapsed, expireMs);
+}
+
+
+/******************************************************************************
+*
+*   Level test
+*
+*   Timers created on one task thread share its wheel, so they must fire
+*   in expiry order. The delays straddle the 256 slots of level zero, the
+*   16K ticks covered by level one, and the wrap of level zero's slots.
+*
+***/
+
+namespace Levels {
+
+static const unsigned DELAYS[] = {
+    0, 1, 2, 7, 100,
+    254, 255, 256, 257, 300, 511, 512, 513,
+    1000, 4095, 4096, 4097,
+    16383, 16384, 16385, 16500,
+};
+static const unsigned TIMERS = _countof(DELAYS);
+
+// Re-armed from OnTimer; crosses several rotations of level zero
+static const unsigned REPEAT_MS     = 7;
+static const unsigned REPEAT_COUNT  = 100;
+
+//=============================================================================
+class CTimer : public ITimerCallback {
+public:
+    unsigned    m_index;
+    unsigned    m_startMs;
+    unsigned    m_firedMs;
+    ITimer *    m_timer;
+
+    unsigned OnTimer ();
+};
+
+//=============================================================================
+class CRepeat : public ITimerCallback {
+public:
+    unsigned    m_count;
+    unsigned    m_lastMs;
+    ITimer *    m_timer;
+
+    unsigned OnTimer ();
+};
+
+static CTimer           s_timers[TIMERS];
+static CRepeat          s_repeat;
+static unsigned         s_order[TIMERS];
+static volatile long    s_fired;
+static volatile long    s_remaining;
+static HANDLE           s_doneEvt;
+static TaskWork         s_createWork;
+
+//=============================================================================
+unsigned CTimer::OnTimer () {
+    m_firedMs = TimeGetMs();
+    s_order[InterlockedIncrement(&s_fired) - 1] = m_index;
+    m_timer->Delete();
+    if (!InterlockedDecrement(&s_remaining))
+        SetEvent(s_doneEvt);
+    return TIMER_INFINITE_MS;
+}
+
+//=============================================================================
+unsigned CRepeat::OnTimer () {
+    unsigned nowMs = TimeGetMs();
+    if (m_count)
+        CheckFired("repeat", m_count, m_lastMs, nowMs, REPEAT_MS, LATE_MS);
+    m_lastMs = nowMs;
+
+    if (++m_count <= REPEAT_COUNT)
+        return REPEAT_MS;
+
+    m_timer->Delete();
+    if (!InterlockedDecrement(&s_remaining))
+        SetEvent(s_doneEvt);
+    return TIMER_INFINITE_MS;
+}
+
+//=============================================================================
+static void CreateProc (void *) {
+    for (unsigned i = 0; i < TIMERS; ++i) {
+        s_timers[i].m_index   = i;
+        s_timers[i].m_startMs = TimeGetMs();
+        TimerCreate(&s_timers[i], DELAYS[i], &s_timers[i].m_timer);
+    }
+
+    s_repeat.m_count  = 0;
+    s_repeat.m_lastMs = TimeGetMs();
+    TimerCreate(&s_repeat, 0, &s_repeat.m_timer);
+}
+
+//=============================================================================
+static bool Run () {
+    s_doneEvt   = CreateEvent(NULL, true, false, NULL);
+    s_fired     = 0;
+    s_remaining = TIMERS + 1;
+    TaskPost(&s_createWork, CreateProc, NULL);
+
+    unsigned waitMs = DELAYS[TIMERS - 1] + 5 * 1000;
+    if (WAIT_OBJECT_0 != WaitForSingleObject(s_doneEvt, waitMs))
+        Fail("levels: timed out with %u timers remaining\n", (unsigned) s_remaining);
+    CloseHandle(s_doneEvt);
+
+    // Timers may have been created a millisecond apart, so only timers
+    // whose expiries differ have to be in order
+    for (unsigned i = 1; i < (unsigned) s_fired; ++i) {
+        const CTimer & prev = s_timers[s_order[i - 1]];
+        const CTimer & curr = s_timers[s_order[i]];
+        int diff = (int) ((curr.m_startMs + DELAYS[curr.m_index]) - (prev.m_startMs + DELAYS[prev.m_index]));
+        if (diff < 0)
+            Fail("levels: timer %u fired before timer %u\n", prev.m_index, curr.m_index);
+    }
+
+    for (unsigned i = 0; i < (unsigned) s_fired; ++i) {
+        const CTimer & timer = s_timers[s_order[i]];
+        CheckFired("levels", timer.m_index, timer.m_startMs, timer.m_firedMs, DELAYS[timer.m_index], LATE_MS);
+    }
+    return !s_failures;
+}
+
+}   // namespace Levels
+
+
+/******************************************************************************
+*
+*   Slack test
+*
+*   Slack rounds each expiry up to a multiple of a power of two no larger
+*   than the slack, so timers a few milliseconds apart expire in the same
+*   tick. With SLACK_MS of 64 and sleeps spread over less than 64ms, the
+*   expiries fall on at most two multiples of 64.
+*
+***/
+
+namespace Slack {
+
+static const unsigned TIMERS    = 41;
+static const unsigned SLEEP_MS  = 100;
+static const unsigned SLACK_MS  = 64;
+static const unsigned GROUPS    = 2;
+
+// Callbacks more than this far apart ran in different ticks
+static const unsigned GROUP_MS  = 2;
+
+//=============================================================================
+class CTimer : public ITimerCallback {
+public:
+    unsigned    m_startMs;
+    unsigned    m_firedMs;
+    ITimer *    m_timer;
+
+    unsigned OnTimer ();
+};
+
+static CTimer           s_timers[TIMERS];
+static volatile long    s_remaining;
+static HANDLE           s_doneEvt;
+static TaskWork         s_createWork;
+
+//=============================================================================
+unsigned CTimer::OnTimer () {
+    m_firedMs = TimeGetMs();
+    m_timer->Delete();
+    if (!InterlockedDecrement(&s_remaining))
+        SetEvent(s_doneEvt);
+    return TIMER_INFINITE_MS;
+}
+
+//=============================================================================
+static void CreateProc (void *) {
+    for (unsigned i = 0; i < TIMERS; ++i) {
+        s_timers[i].m_startMs = TimeGetMs();
+        TimerCreate(&s_timers[i], SLEEP_MS + i, &s_timers[i].m_timer, SLACK_MS);
+    }
+}
+
+//=============================================================================
+static bool Run () {
+    unsigned failures = (unsigned) s_failures;
+
+    s_doneEvt   = CreateEvent(NULL, true, false, NULL);
+    s_remaining = TIMERS;
+    TaskPost(&s_createWork, CreateProc, NULL);
+
+    bool done = WAIT_OBJECT_0 == WaitForSingleObject(s_doneEvt, 5 * 1000);
+    CloseHandle(s_doneEvt);
+    if (!done) {
+        Fail("slack: timed out with %u timers remaining\n", (unsigned) s_remaining);
+        return false;
+    }
+
+    // Never before the expiry, and no later than the slack allows
+    for (unsigned i = 0; i < TIMERS; ++i) {
+        const CTimer & timer = s_timers[i];
+        CheckFired("slack", i, timer.m_startMs, timer.m_firedMs, SLEEP_MS + i, SLACK_MS + LATE_MS);
+    }
+
+    // Timers that fired together were called back within a few milliseconds
+    unsigned groups = 0;
+    for (unsigned i = 0; i < TIMERS; ++i) {
+        bool joined = false;
+        for (unsigned j = 0; j < i && !joined; ++j) {
+            int diff = (int) (s_timers[i].m_firedMs - s_timers[j].m_firedMs);
+            joined = diff >= -(int) GROUP_MS && diff <= (int) GROUP_MS;
+        }
+        if (!joined)
+            ++groups;
+    }
+    if (groups > GROUPS)
+        Fail("slack: timers fired in %u groups, expected at most %u\n", groups, GROUPS);
+
+    return (unsigned) s_failures == failures;
+}
+
+}   // namespace Slack
+
+
+/******************************************************************************
+*
+*   Foreign thread test
+*
+*   The main thread isn't a task thread, so its calls to Set and Delete go
+*   through the owning wheel's mailbox.
+*
+***/
+
+namespace Foreign {
+
+static const unsigned STRESS_TIMERS = 1000;
+static const unsigned STRESS_MAX_MS = 50;
+
+//=============================================================================
+class CTimer : public ITimerCallback {
+public:
+    volatile long   m_fires;
+    unsigned        m_firedMs;
+    ITimer *        m_timer;
+
+    CTimer () : m_fires(0), m_firedMs(0), m_timer(NULL) {}
+
+    unsigned OnTimer () {
+        m_firedMs = TimeGetMs();
+        InterlockedIncrement(&m_fires);
+        return TIMER_INFINITE_MS;
+    }
+};
+
+//=============================================================================
+static bool Run () {
+    unsigned failures = (unsigned) s_failures;
+
+    // Set from another thread arms the timer
+    CTimer set;
+    TimerCreate(&set, TIMER_INFINITE_MS, &set.m_timer);
+    unsigned setStartMs = TimeGetMs();
+    set.m_timer->Set(50);
+
+    // Delete from another thread before the expiry stops the callback
+    CTimer deleted;
+    TimerCreate(&deleted, 100, &deleted.m_timer);
+    Sleep(10);
+    deleted.m_timer->Delete();
+
+    // The latest Set wins, including over one still in the mailbox
+    CTimer reset;
+    unsigned resetStartMs = TimeGetMs();
+    TimerCreate(&reset, 1000, &reset.m_timer);
+    reset.m_timer->Set(30);
+
+    // Stopping with TIMER_INFINITE_MS
+    CTimer stopped;
+    TimerCreate(&stopped, 20, &stopped.m_timer);
+    stopped.m_timer->Set(TIMER_INFINITE_MS);
+
+    // Many timers dealt across the wheels and set repeatedly; odd ones are
+    // stopped afterwards, though they may already have fired
+    CTimer * stress = new CTimer[STRESS_TIMERS];
+    for (unsigned i = 0; i < STRESS_TIMERS; ++i)
+        TimerCreate(&stress[i], TIMER_INFINITE_MS, &stress[i].m_timer);
+    for (unsigned pass = 0; pass < 3; ++pass) {
+        for (unsigned i = 0; i < STRESS_TIMERS; ++i)
+            stress[i].m_timer->Set((i * 7 + pass) % STRESS_MAX_MS);
+    }
+    for (unsigned i = 1; i < STRESS_TIMERS; i += 2)
+        stress[i].m_timer->Set(TIMER_INFINITE_MS);
+
+    Sleep(1200);
+
+    if (set.m_fires != 1)
+        Fail("foreign: Set timer fired %u times\n", (unsigned) set.m_fires);
+    else
+        CheckFired("foreign set", 0, setStartMs, set.m_firedMs, 50, LATE_MS);
+
+    if (deleted.m_fires)
+        Fail("foreign: deleted timer fired\n");
+
+    if (reset.m_fires != 1)
+        Fail("foreign: reset timer fired %u times\n", (unsigned) reset.m_fires);
+    else
+        CheckFired("foreign reset", 0, resetStartMs, reset.m_firedMs, 30, LATE_MS);
+
+    if (stopped.m_fires)
+        Fail("foreign: stopped timer fired\n");
+
+    // A timer fires at most once per Set; the even ones are left armed
+    // and must have fired at least once
+    for (unsigned i = 0; i < STRESS_TIMERS; ++i) {
+        unsigned fires = (unsigned) stress[i].m_fires;
+        if ((i & 1) == 0 && !fires)
+            Fail("foreign: stress timer %u never fired\n", i);
+        if (fires > 3)
+            Fail("foreign: stress timer %u fired %u times\n", i, fires);
+    }
+
+    // The timers are freed by their owners, and never call back again
+    set.m_timer->Delete();
+    reset.m_timer->Delete();
+    stopped.m_timer->Delete();
+    for (unsigned i = 0; i < STRESS_TIMERS; ++i)
+        stress[i].m_timer->Delete();
+    Sleep(100);
+    delete [] stress;
+
+    return (unsigned) s_failures == failures;
+}
+
+}   // namespace Foreign
+
+
+/******************************************************************************
+*
+*   Set and delete test
+*
+*   Deletes a timer from another thread right after setting it, so that the
+*   owner is often applying the Set while the Delete is being posted. A
+*   timer freed too early shows up as a crash or heap corruption.
+*
+***/
+
+namespace Churn {
+
+static const unsigned TIMERS = 200 * 1000;
+
+//=============================================================================
+class CTimer : public ITimerCallback {
+public:
+    volatile long   m_fires;
+
+    CTimer () : m_fires(0) {}
+
+    unsigned OnTimer () {
+        InterlockedIncrement(&m_fires);
+        return TIMER_INFINITE_MS;
+    }
+};
+
+static CTimer   s_callback;
+
+//=============================================================================
+static bool Run () {
+    for (unsigned i = 0; i < TIMERS; ++i) {
+        ITimer * timer;
+        TimerCreate(&s_callback, TIMER_INFINITE_MS, &timer);
+        timer->Set(i & 1);
+        timer->Delete();
+    }
+
+    // Let the owners free the last of them
+    Sleep(100);
+    return true;
+}
+
+}   // namespace Churn
+
+
+/******************************************************************************
+*
+*   Main
+*
+***/
+
+//=============================================================================
+int _tmain(int argc, _TCHAR* argv[]) {
+    TaskInitialize();
+    TimerInitialize();
+
+    bool passed = Levels::Run();
+    passed = Slack::Run() && passed;
+    passed = Foreign::Run() && passed;
+    passed = Churn::Run() && passed;
+    printf("%s\n", passed ? "PASS" : "FAIL");
+
+    TimerDestroy();
+    TaskDestroy();
+    return passed ? 0 : 1;
+}
+
+
+//===================================
+// MIT License
+//
+// Copyright (c) 2010 by Patrick Wyatt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===================================